@@ -0,0 +1,182 @@
+/*      SC      A Spreadsheet Calculator
+ *              Aggregate kernels for range functions
+ *
+ *              Scan blocks of mirrored column values (see colmirror_t)
+ *              and compute the count, sum, sum of squares, minimum and
+ *              maximum in a single pass. SSE2 and AVX2 versions are
+ *              selected at run time on x86 targets.
+ *
+ *              $Revision: 9.1 $
+ */
+
+#include <math.h>
+#include "sc.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(__TINYC__) \
+&&  (defined(__x86_64__) || defined(__i386__))
+#define SC_X86_KERNELS  1
+#include <immintrin.h>
+#endif
+
+/* Values are selected with the same rules as eval_aggregate():
+   numbers are always included, booleans are included with their value
+   if allvalues is set, strings and errors are included as 0 if
+   allvalues is set, empty cells are ignored.
+ */
+static void aggregate_scalar(aggrvec_t *ap, const double *v,
+                             const unsigned char *type, int n, int allvalues)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        double x;
+        switch (type[i]) {
+        case SC_NUMBER:
+            x = v[i];
+            break;
+        case SC_BOOLEAN:
+            if (!allvalues) continue;
+            x = v[i];
+            break;
+        case SC_STRING:
+        case SC_ERROR:
+            if (!allvalues) continue;
+            x = 0.0;
+            break;
+        default:
+            continue;
+        }
+        ap->count++;
+        ap->sum += x;
+        ap->sum2 += x * x;
+        if (ap->min > x) ap->min = x;
+        if (ap->max < x) ap->max = x;
+    }
+}
+
+#ifdef SC_X86_KERNELS
+__attribute__((target("sse2")))
+static void aggregate_sse2(aggrvec_t *ap, const double *v,
+                           const unsigned char *type, int n, int allvalues)
+{
+    __m128d vsum = _mm_setzero_pd();
+    __m128d vsum2 = _mm_setzero_pd();
+    __m128d vmin = _mm_set1_pd(HUGE_VAL);
+    __m128d vmax = _mm_set1_pd(-HUGE_VAL);
+    __m128d pinf = vmin, minf = vmax;
+    double res[2];
+    int i, count = 0;
+    int tbool = allvalues ? SC_BOOLEAN : SC_NUMBER;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        int t0 = type[i], t1 = type[i + 1];
+        int num0 = (t0 == SC_NUMBER || t0 == tbool);
+        int num1 = (t1 == SC_NUMBER || t1 == tbool);
+        int inc0 = num0 || (allvalues && t0 != SC_EMPTY);
+        int inc1 = num1 || (allvalues && t1 != SC_EMPTY);
+        __m128d isnum = _mm_castsi128_pd(_mm_set_epi64x(-(long long)num1, -(long long)num0));
+        __m128d incl = _mm_castsi128_pd(_mm_set_epi64x(-(long long)inc1, -(long long)inc0));
+        __m128d x = _mm_and_pd(_mm_loadu_pd(v + i), isnum);
+        vsum = _mm_add_pd(vsum, x);
+        vsum2 = _mm_add_pd(vsum2, _mm_mul_pd(x, x));
+        vmin = _mm_min_pd(vmin, _mm_or_pd(_mm_and_pd(incl, x), _mm_andnot_pd(incl, pinf)));
+        vmax = _mm_max_pd(vmax, _mm_or_pd(_mm_and_pd(incl, x), _mm_andnot_pd(incl, minf)));
+        count += inc0 + inc1;
+    }
+    _mm_storeu_pd(res, vsum);
+    ap->sum += res[0] + res[1];
+    _mm_storeu_pd(res, vsum2);
+    ap->sum2 += res[0] + res[1];
+    _mm_storeu_pd(res, vmin);
+    if (ap->min > res[0]) ap->min = res[0];
+    if (ap->min > res[1]) ap->min = res[1];
+    _mm_storeu_pd(res, vmax);
+    if (ap->max < res[0]) ap->max = res[0];
+    if (ap->max < res[1]) ap->max = res[1];
+    ap->count += count;
+    aggregate_scalar(ap, v + i, type + i, n - i, allvalues);
+}
+
+__attribute__((target("avx2")))
+static void aggregate_avx2(aggrvec_t *ap, const double *v,
+                           const unsigned char *type, int n, int allvalues)
+{
+    __m256d vsum = _mm256_setzero_pd();
+    __m256d vsum2 = _mm256_setzero_pd();
+    __m256d vmin = _mm256_set1_pd(HUGE_VAL);
+    __m256d vmax = _mm256_set1_pd(-HUGE_VAL);
+    __m256d pinf = vmin, minf = vmax;
+    __m256i vcount = _mm256_setzero_si256();
+    __m256i tnum = _mm256_set1_epi64x(SC_NUMBER);
+    __m256i tbool = _mm256_set1_epi64x(allvalues ? SC_BOOLEAN : SC_NUMBER);
+    __m256i tempty = _mm256_set1_epi64x(SC_EMPTY);
+    __m256i all = _mm256_set1_epi64x(allvalues ? -1 : 0);
+    double res[4];
+    long long cnt[4];
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        int t4;
+        __m256i t, isnum, incl;
+        __m256d x;
+        memcpy(&t4, type + i, sizeof t4);
+        t = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(t4));
+        isnum = _mm256_or_si256(_mm256_cmpeq_epi64(t, tnum), _mm256_cmpeq_epi64(t, tbool));
+        incl = _mm256_or_si256(isnum, _mm256_andnot_si256(_mm256_cmpeq_epi64(t, tempty), all));
+        x = _mm256_and_pd(_mm256_loadu_pd(v + i), _mm256_castsi256_pd(isnum));
+        vsum = _mm256_add_pd(vsum, x);
+        vsum2 = _mm256_add_pd(vsum2, _mm256_mul_pd(x, x));
+        vmin = _mm256_min_pd(vmin, _mm256_blendv_pd(pinf, x, _mm256_castsi256_pd(incl)));
+        vmax = _mm256_max_pd(vmax, _mm256_blendv_pd(minf, x, _mm256_castsi256_pd(incl)));
+        vcount = _mm256_sub_epi64(vcount, incl);
+    }
+    _mm256_storeu_pd(res, vsum);
+    ap->sum += (res[0] + res[1]) + (res[2] + res[3]);
+    _mm256_storeu_pd(res, vsum2);
+    ap->sum2 += (res[0] + res[1]) + (res[2] + res[3]);
+    _mm256_storeu_pd(res, vmin);
+    if (ap->min > res[0]) ap->min = res[0];
+    if (ap->min > res[1]) ap->min = res[1];
+    if (ap->min > res[2]) ap->min = res[2];
+    if (ap->min > res[3]) ap->min = res[3];
+    _mm256_storeu_pd(res, vmax);
+    if (ap->max < res[0]) ap->max = res[0];
+    if (ap->max < res[1]) ap->max = res[1];
+    if (ap->max < res[2]) ap->max = res[2];
+    if (ap->max < res[3]) ap->max = res[3];
+    _mm256_storeu_si256((__m256i *)(void *)cnt, vcount);
+    ap->count += (int)(cnt[0] + cnt[1] + cnt[2] + cnt[3]);
+    aggregate_scalar(ap, v + i, type + i, n - i, allvalues);
+}
+#endif
+
+static void (*aggregate_kernel)(aggrvec_t *ap, const double *v,
+                                const unsigned char *type, int n, int allvalues) = aggregate_scalar;
+
+/* select the kernels for the CPU at startup, before the recalc threads
+   can use them */
+void aggregate_init(void) {
+#ifdef SC_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        aggregate_kernel = aggregate_avx2;
+    else
+    if (__builtin_cpu_supports("sse2"))
+        aggregate_kernel = aggregate_sse2;
+#endif
+}
+
+void aggrvec_init(aggrvec_t *ap) {
+    ap->count = 0;
+    ap->sum = ap->sum2 = 0.0;
+    ap->min = HUGE_VAL;
+    ap->max = -HUGE_VAL;
+}
+
+/* accumulate n mirrored values into *ap */
+void aggregate_values(aggrvec_t *ap, const double *v, const unsigned char *type,
+                      int n, int allvalues)
+{
+    if (n > 0)
+        aggregate_kernel(ap, v, type, n, allvalues);
+}
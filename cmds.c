@@ -20,7 +20,13 @@
  * and 2 temporary registers.
  */
 
+typedef struct rowptr {
+    short mincol, maxcol;
+    SCXMEM struct ent **cp;
+} rowptr_t;
+
 typedef struct subsheet {
+    sheet_t *sp;    /* sheet owning the cells */
     int minrow, mincol, maxrow, maxcol;
     int ncols, nrows, num, refs;
     SCXMEM rowptr_t *tbl;
@@ -41,11 +47,7 @@ static subsheet_t delbuf_array[DELBUF_COUNT];
 static subsheet_t *delbuf[DELBUF_COUNT];
 static int qbuf;       /* register no. specified by " command */
 
-/* a linked list of free [struct ent]'s, uses .next as the pointer */
-static struct ent *free_ents;
-
-#define ATBL(sp, row, col)     (&(sp)->tbl[row].cp[col])
-
+static void ent_arena_free(sheet_t *sp);
 static int any_locked_cells(sheet_t *sp, rangeref_t rr);
 static void move_area(sheet_t *sp, int dr, int dc, rangeref_t rr);
 static void yank_area(sheet_t *sp, int idx, rangeref_t rr);
@@ -61,19 +63,110 @@ static void ent_copy(sheet_t *sp, struct ent *n, struct ent *p,
 #define sync_refs(sp)
 #define sync_ranges(sp)
 
-static void ent_free(struct ent *p) {
+static void ent_free(sheet_t *sp, struct ent *p) {
     if (p) {
         efree(p->expr);
         p->expr = NULL;
-        string_set(&p->label, NULL);
-        string_set(&p->format, NULL);
-        p->v = 0.0;
-        p->cellerror = 0;
-        p->type = SC_EMPTY;
+        ent_clear_value(p);
+        ent_set_format(p, NULL);
         p->flags = IS_CHANGED | IS_CLEARED;
-        p->next = free_ents;     /* put this ent on the front of free_ents */
-        free_ents = p;
+        p->next = sp->cells.free_ents;  /* put this ent on the front of free_ents */
+        sp->cells.free_ents = p;
+    }
+}
+
+/*---------------- cell format side table ----------------*/
+
+/* Few cells have a specific format: formats are kept in a hash table
+   keyed by cell address and HAS_FORMAT is set in the cell flags.
+ */
+typedef struct cellformat {
+    SCXMEM struct cellformat *next;
+    struct ent *p;
+    SCXMEM string_t *format;
+} cellformat_t;
+
+static SCXMEM cellformat_t **format_tbl;
+static size_t format_size, format_count;
+
+static size_t format_hash(struct ent *p, size_t size) {
+    return ((size_t)p / sizeof(*p) * 2654435761U) & (size - 1);
+}
+
+string_t *ent_format(struct ent *p) {
+    cellformat_t *fp;
+    if (!p || !(p->flags & HAS_FORMAT))
+        return NULL;
+    for (fp = format_tbl[format_hash(p, format_size)]; fp; fp = fp->next) {
+        if (fp->p == p)
+            return fp->format;
+    }
+    return NULL;
+}
+
+static int format_grow(void) {
+    size_t i, size = format_size ? format_size * 2 : 256;
+    cellformat_t **tbl = scxmalloc(size * sizeof(*tbl));
+    if (!tbl)
+        return 0;
+    for (i = 0; i < size; i++)
+        tbl[i] = NULL;
+    for (i = 0; i < format_size; i++) {
+        cellformat_t *fp, *next;
+        for (fp = format_tbl[i]; fp; fp = next) {
+            size_t h = format_hash(fp->p, size);
+            next = fp->next;
+            fp->next = tbl[h];
+            tbl[h] = fp;
+        }
+    }
+    scxfree(format_tbl);
+    format_tbl = tbl;
+    format_size = size;
+    return 1;
+}
+
+/* set or clear the format of a cell, takes ownership of the string */
+void ent_set_format(struct ent *p, SCXMEM string_t *format) {
+    cellformat_t **fpp, *fp;
+
+    if (p->flags & HAS_FORMAT) {
+        for (fpp = &format_tbl[format_hash(p, format_size)]; (fp = *fpp) != NULL; fpp = &fp->next) {
+            if (fp->p == p) {
+                if (format) {
+                    string_set(&fp->format, format);
+                    return;
+                }
+                *fpp = fp->next;
+                string_free(fp->format);
+                scxfree(fp);
+                format_count--;
+                break;
+            }
+        }
+        p->flags &= ~HAS_FORMAT;
     }
+    if (format) {
+        if (format_count >= format_size && !format_grow())
+            goto fail;
+        if (!(fp = scxmalloc(sizeof(*fp))))
+            goto fail;
+        fpp = &format_tbl[format_hash(p, format_size)];
+        fp->p = p;
+        fp->format = format;
+        fp->next = *fpp;
+        *fpp = fp;
+        format_count++;
+        p->flags |= HAS_FORMAT;
+    }
+    if (!format_count && format_tbl) {
+        scxfree(format_tbl);
+        format_tbl = NULL;
+        format_size = 0;
+    }
+    return;
+ fail:
+    string_free(format);
 }
 
 void delbuf_init(void) {
@@ -126,7 +219,7 @@ static void delbuf_free(int idx) {
             for (c = 0; c < db->ncols; c++) {
                 struct ent *p = db->tbl[r].cp[c];
                 if (p) {
-                    ent_free(p);
+                    ent_free(db->sp, p);
                     db->tbl[r].cp[c] = NULL;
                 }
             }
@@ -196,32 +289,30 @@ void delbuf_list(sheet_t *sp, FILE *f) {
     if (!n) fprintf(f, "  No active registers\n");
 }
 
-void delbuf_clean(void) {
-    struct ent *p, *next;
+void delbuf_clean(sheet_t *sp) {
     int i;
 
     for (i = 0; i < DELBUF_COUNT; i++) {
         delbuf_free(i);
     }
-    for (p = free_ents, free_ents = NULL; p; p = next) {
-        next = p->next;
-        scxfree(p);
-    }
+    ent_arena_free(sp);
 }
 
 static void delbuf_setcell(subsheet_t *db, int row, int col, struct ent *p) {
     if (db && row >= db->minrow && row <= db->maxrow && col >= db->mincol && col <= db->maxcol) {
         db->tbl[row - db->minrow].cp[col - db->mincol] = p;
     } else {
-        ent_free(p);
+        ent_free(db->sp, p);
     }
 }
 
 struct ent *getcell(sheet_t *sp, int row, int col) {
-    if (row >= 0 && row <= sp->maxrow && col >= 0 && col <= sp->maxcol)
-        return *ATBL(sp, row, col);
-    else
+    if (row >= 0 && row <= sp->maxrow && col >= 0 && col <= sp->maxcol) {
+        struct ent **pp = tbl_slot(sp, row, col);
+        return pp ? *pp : NULL;
+    } else {
         return NULL;
+    }
 }
 
 int valid_cell(sheet_t *sp, int row, int col) {
@@ -232,11 +323,18 @@ int valid_cell(sheet_t *sp, int row, int col) {
 // XXX: should extend sheet if required and p != NULL
 static int setcell(sheet_t *sp, int row, int col, struct ent *p) {
     if (row >= 0 && row <= sp->maxrow && col >= 0 && col <= sp->maxcol) {
-        struct ent **pp = ATBL(sp, row, col);
-        if (*pp && *pp != p) {
-            ent_free(*pp);
+        struct ent **pp = p ? tbl_slot_alloc(sp, row, col) : tbl_slot(sp, row, col);
+        if (pp) {
+            if (*pp && *pp != p) {
+                ent_free(sp, *pp);
+            }
+            *pp = p;
+            colmirror_touch(sp, row, col);
+            depgraph_invalidate(sp);
+        } else
+        if (p) {
+            return 0;
         }
-        *pp = p;
         FullUpdate++;  // XXX: really?
         changed++;
         sp->modflg++;
@@ -246,25 +344,71 @@ static int setcell(sheet_t *sp, int row, int col, struct ent *p) {
 }
 
 static struct ent *ent_alloc(sheet_t *sp) {
+    entarena_t *ap = &sp->cells;
     struct ent *p;
-    if ((p = free_ents) != NULL) {
-        free_ents = p->next;
+    if ((p = ap->free_ents) != NULL) {
+        ap->free_ents = p->next;
     } else {
-        p = scxmalloc(sizeof(struct ent));
-        if (!p)
-            return NULL;
+        if (!ap->avail) {
+            entslab_t *slab = scxmalloc(sizeof(*slab));
+            if (!slab)
+                return NULL;
+            slab->next = ap->slabs;
+            ap->slabs = slab;
+            ap->avail = ENT_SLAB_SIZE;
+        }
+        p = &ap->slabs->ents[ENT_SLAB_SIZE - ap->avail--];
     }
     p->v = 0.0;
-    p->label = NULL;
     p->expr = NULL;
-    p->format = NULL;
     p->cellerror = 0;
     p->type = SC_EMPTY;
     p->flags = MAY_SYNC;
-    p->next = NULL;
     return p;
 }
 
+/* release the cell arena of a sheet in a few calls to scxfree().
+   Cells still held in registers are moved to a new arena.
+ */
+static void ent_arena_free(sheet_t *sp) {
+    entarena_t old = sp->cells;
+    entslab_t *slab, *next;
+    int i, r, c;
+
+    sp->cells.slabs = NULL;
+    sp->cells.free_ents = NULL;
+    sp->cells.avail = 0;
+    for (i = 0; i < DELBUF_COUNT; i++) {
+        subsheet_t *db = delbuf_array + i;
+        if (!db->refs || db->sp != sp) continue;
+        for (r = 0; r < db->nrows; r++) {
+            for (c = 0; c < db->ncols; c++) {
+                struct ent *p = db->tbl[r].cp[c];
+                if (p) {
+                    struct ent *n = ent_alloc(sp);
+                    string_t *format = string_dup(ent_format(p));
+                    ent_set_format(p, NULL);
+                    if (n) {
+                        *n = *p;
+                        ent_set_format(n, format);
+                        db->tbl[r].cp[c] = n;
+                    } else {
+                        /* lose the cell but not its contents */
+                        db->tbl[r].cp[c] = NULL;
+                        efree(p->expr);
+                        ent_clear_value(p);
+                        string_free(format);
+                    }
+                }
+            }
+        }
+    }
+    for (slab = old.slabs; slab; slab = next) {
+        next = slab->next;
+        scxfree(slab);
+    }
+}
+
 /* return a pointer to a cell structure [struct ent *],
    extending the sheet and allocating the structure if needed
  */
@@ -279,7 +423,11 @@ struct ent *lookat(sheet_t *sp, int row, int col) {
         if (sp->maxrow < row) sp->maxrow = row;
         if (sp->maxcol < col) sp->maxcol = col;
     }
-    pp = ATBL(sp, row, col);
+    pp = tbl_slot_alloc(sp, row, col);
+    if (pp == NULL)
+        return NULL;
+    /* the caller is likely to modify the cell */
+    colmirror_touch(sp, row, col);
     if (*pp == NULL) {
         *pp = ent_alloc(sp);
     }
@@ -414,17 +562,15 @@ int insert_rows(sheet_t *sp, cellref_t cr, int arg, int delta) {
          * row in place of the first
          */
         // XXX: this seems bogus, should implement a rotation
-        rowptr_t tmp_row = sp->tbl[sp->maxrow];
         rowfmt_t tmp_fmt = sp->rowfmt[sp->maxrow];
 
         for (r = sp->maxrow; r > lim; r--) {
             sp->rowfmt[r] = sp->rowfmt[r-arg];
             sp->rowfmt[r-arg] = sp->rowfmt[r-1];
-            sp->tbl[r] = sp->tbl[r-arg];
-            sp->tbl[r-arg] = sp->tbl[r-1];
         }
         sp->rowfmt[r] = tmp_fmt;
-        sp->tbl[r] = tmp_row;               /* the last row was never used.... */
+        /* the inserted rows were beyond the active area, hence empty */
+        tbl_move_area(sp, rangeref(cr.row + delta, 0, sp->maxrow - arg, sp->maxcol), arg, 0);
     }
     /* Adjust range references. */
     adjust_ctx.sp = sp;
@@ -453,8 +599,7 @@ int insert_rows(sheet_t *sp, cellref_t cr, int arg, int delta) {
  * return 0 on failure, 1 on success
  */
 int insert_cols(sheet_t *sp, cellref_t cr, int arg, int delta) {
-    int r, c;
-    struct ent **pp;
+    int c;
     /* cols are moved from sc1:sc2 to dc1:dc2 */
     int sc1 = cr.col + delta;
     int sc2 = sp->maxcol;
@@ -476,15 +621,7 @@ int insert_cols(sheet_t *sp, cellref_t cr, int arg, int delta) {
         sp->colfmt[c] = def_colfmt;
     }
 
-    for (r = 0; r <= sp->maxrow; r++) {
-        // XXX: should factorize as movecell()
-        pp = ATBL(sp, r, 0);
-        for (c = dc2; c >= dc1; c--) {
-            if ((pp[c] = pp[c - arg])) {
-                pp[c - arg] = NULL;
-            }
-        }
-    }
+    tbl_move_area(sp, rangeref(0, sc1, sp->maxrow, sc2), 0, arg);
 
     /* Adjust range references. */
     adjust_ctx.sp = sp;
@@ -570,7 +707,7 @@ void delete_rows(sheet_t *sp, int r1, int r2) {
             fr = NULL;
         }
     } else {
-        /* moving whole rows by swapping row pointers */
+        /* moving whole rows up, the deleted rows are empty */
         int r, dr;
         rowfmt_t def_rowfmt = { FALSE };
 
@@ -579,16 +716,13 @@ void delete_rows(sheet_t *sp, int r1, int r2) {
             sp->rowfmt[r] = def_rowfmt;
         }
 
-        /* rotate row pointers and row formats */
+        /* rotate row formats */
         for (dr = r1; r <= sp->maxrow; r++, dr++) {
-            /* swap rows and fix cell entries */
-            rowptr_t tmprow = sp->tbl[dr];
             rowfmt_t tmpfmt = sp->rowfmt[dr];
-            sp->tbl[dr] = sp->tbl[r];
             sp->rowfmt[dr] = sp->rowfmt[r];
-            sp->tbl[r] = tmprow;
             sp->rowfmt[r] = tmpfmt;
         }
+        tbl_move_area(sp, rangeref(r2 + 1, 0, sp->maxrow, sp->maxcol), -nrows, 0);
     }
     /* Adjust range references. */
     adjust_ctx.sp = sp;
@@ -681,15 +815,19 @@ static void kill_area(sheet_t *sp, int idx, rangeref_t rr, int flags) {
     if (er > sp->maxrow) er = sp->maxrow;
     if (ec > sp->maxcol) ec = sp->maxcol;
 
+    for (c = sc; c <= ec; c++) {
+        colmirror_invalidate(sp, c);
+    }
+    depgraph_invalidate(sp);
     if (idx < 0) {
         /* just free the allocated cells */
         for (r = sr; r <= er; r++) {
             for (c = sc; c <= ec; c++) {
-                struct ent **pp = ATBL(sp, r, c);
-                struct ent *p = *pp;
+                struct ent **pp = tbl_slot(sp, r, c);
+                struct ent *p = pp ? *pp : NULL;
                 if (p) {
                     *pp = NULL;
-                    ent_free(p);
+                    ent_free(sp, p);
                     FullUpdate++;  // XXX: really?
                     changed++;
                     sp->modflg++;
@@ -703,6 +841,7 @@ static void kill_area(sheet_t *sp, int idx, rangeref_t rr, int flags) {
     db = delbuf_find(idx);
     if (!db)
         return;
+    db->sp = sp;
     db->minrow = sr;
     db->mincol = sc;
     db->maxrow = er;
@@ -749,8 +888,8 @@ static void kill_area(sheet_t *sp, int idx, rangeref_t rr, int flags) {
         for (r = sr; r <= er; r++) {
             for (c = sc; c <= ec; c++) {
                 /* move a cell to the delbuf subsheet */
-                struct ent **pp = ATBL(sp, r, c);
-                struct ent *p = *pp;
+                struct ent **pp = tbl_slot(sp, r, c);
+                struct ent *p = pp ? *pp : NULL;
                 if (p) {
                     *pp = NULL;
                     p->flags |= IS_DELETED;
@@ -827,6 +966,7 @@ void valueize_area(sheet_t *sp, rangeref_t rr) {
             if (p && p->expr) {
                 efree(p->expr);
                 p->expr = NULL;
+                depgraph_edit(sp, r, c);
                 sp->modflg++;
             }
         }
@@ -1012,7 +1152,7 @@ void cmd_pullcells(sheet_t *sp, int cmd, int uarg) {
 
 /* delete group of columns (1 or more) */
 void delete_cols(sheet_t *sp, int c1, int c2) {
-    int r, c, ncols, save = sp->curcol;
+    int c, ncols, save = sp->curcol;
     colfmt_t def_colfmt = { FALSE, DEFWIDTH, DEFPREC, DEFREFMT };
     adjust_ctx_t adjust_ctx;
 
@@ -1045,16 +1185,8 @@ void delete_cols(sheet_t *sp, int c1, int c2) {
     delbuf_copy(DELBUF_DEF, DELBUF_1);
     delbuf_unsync(DELBUF_DEF);
 
-    /* clear then copy the block left */
-    for (r = 0; r <= sp->maxrow; r++) {
-        for (c = c1; c <= sp->maxcol - ncols; c++) {
-            // XXX: should factorize as movecell()
-            struct ent **pp = ATBL(sp, r, c);
-            if ((*pp = pp[ncols])) {
-                pp[ncols] = NULL;
-            }
-        }
-    }
+    /* copy the block left */
+    tbl_move_area(sp, rangeref(0, c2 + 1, sp->maxrow, sp->maxcol), 0, -ncols);
 
     for (c = c1; c <= sp->maxcol - ncols; c++) {
         sp->colfmt[c] = sp->colfmt[c + ncols];
@@ -1316,16 +1448,14 @@ void fill_range(sheet_t *sp, rangeref_t rr, double start, double inc, int bycols
     if (any_locked_cells(sp, rr))
         return;
 
+    depgraph_dirty_all(sp);
     // XXX: should use set_cell_value with an scvalue_t
     for (c = rr.left.col, r = rr.left.row;;) {
         struct ent *p = lookat(sp, r, c);
         if (!p)
             break;
-        if (p->type == SC_STRING) {
-            string_set(&p->label, NULL); /* free the previous label */
-        }
+        ent_clear_value(p);
         p->type = SC_NUMBER;
-        p->cellerror = 0;
         p->flags |= IS_CHANGED;
         p->v = start;
         start += inc;
@@ -1405,13 +1535,13 @@ void format_cells(sheet_t *sp, rangeref_t rr, SCXMEM string_t *str) {
             if (str) {
                 struct ent *p = lookat(sp, r, c);
                 if (p) {
-                    string_set(&p->format, string_dup(str));
+                    ent_set_format(p, string_dup(str));
                     p->flags |= IS_CHANGED;
                 }
             } else {
                 struct ent *p = getcell(sp, r, c);
-                if (p && p->format) {
-                    string_set(&p->format, NULL);
+                if (p && (p->flags & HAS_FORMAT)) {
+                    ent_set_format(p, NULL);
                     p->flags |= IS_CHANGED;
                 }
             }
@@ -1626,6 +1756,9 @@ void adjust_refs(adjust_ctx_t *ap) {
     struct ent *p;
     sheet_t *sp;
 
+    /* references are about to change */
+    depgraph_invalidate(ap->sp);
+
     /* Update all marked cells. */
     for (i = 0; i < MARK_COUNT; i++) {
         cell_adjust(ap, &ap->sp->savedcr[i]);
@@ -1642,8 +1775,10 @@ void adjust_refs(adjust_ctx_t *ap) {
     sp = ap->sp;
     for (row = 0; row <= sp->maxrow; row++) {
         for (col = 0; col <= sp->maxcol; col++) {
-            if ((p = getcell(sp, row, col)) && p->expr)
+            if ((p = getcell(sp, row, col)) && p->expr) {
                 enode_adjust(ap, p->expr);
+                enode_compile(p->expr);
+            }
         }
     }
     /* Enumerate delbuf_array with sheet number */
@@ -1653,8 +1788,10 @@ void adjust_refs(adjust_ctx_t *ap) {
         for (r = 0; r < db->nrows; r++) {
             for (c = 0; c < db->ncols; c++) {
                 p = db->tbl[r].cp[c];
-                if (p && p->expr)
+                if (p && p->expr) {
                     enode_adjust(ap, p->expr);
+                    enode_compile(p->expr);
+                }
             }
         }
     }
@@ -1778,12 +1915,20 @@ static void ent_copy(sheet_t *sp, struct ent *n, struct ent *p, int dr, int dc,
     if (special != 'f') {
         /* transfer value unless merging and no value */
         if (special != 'm' || hasvalue) {
+            ent_clear_value(n);
             n->type = p->type;
             n->cellerror = p->cellerror;
-            n->v = p->v;
-            string_set(&n->label, string_dup(p->label));
+            if (p->type == SC_STRING)
+                n->label = string_dup(p->label);
+            else
+                n->v = p->v;
+            /* the position of n is unknown, recalc all formulas */
+            if (n->expr || p->expr)
+                depgraph_invalidate(sp);
+            else
+                depgraph_dirty_all(sp);
             efree(n->expr);
-            n->expr = copye(sp, p->expr, dr, dc, r1, c1, r2, c2, special == 't');
+            n->expr = enode_pack(copye(sp, p->expr, dr, dc, r1, c1, r2, c2, special == 't'));
             n->flags |= IS_CHANGED;
         }
     }
@@ -1791,12 +1936,12 @@ static void ent_copy(sheet_t *sp, struct ent *n, struct ent *p, int dr, int dc,
         /* transfer alignment and LOCKED flag */
         n->flags &= ~(ALIGN_MASK | IS_LOCKED);
         n->flags |= p->flags & (ALIGN_MASK | IS_LOCKED);
-        if (p->format) {
-            string_set(&n->format, string_dup(p->format));
+        if (p->flags & HAS_FORMAT) {
+            ent_set_format(n, string_dup(ent_format(p)));
         } else
         if (special != 'm' && special != 'f') {
             // XXX: why not reset format if special == 'f' ?
-            string_set(&n->format, NULL);
+            ent_set_format(n, NULL);
         }
         n->flags |= IS_CHANGED;
     }
@@ -1804,32 +1949,39 @@ static void ent_copy(sheet_t *sp, struct ent *n, struct ent *p, int dr, int dc,
 
 /* erase the database (sheet data, etc.) */
 void erasedb(sheet_t *sp) {
-    int r, c;
-
-    for (r = 0; r <= sp->maxrow; r++) {
-        for (c = 0; c <= sp->maxcol; c++) {
-            // XXX: should factorize as erasecell()
-            struct ent **pp = ATBL(sp, r, c);
-            struct ent *p = *pp;
-            if (p) {
-                *pp = NULL;
-                efree(p->expr);
-                p->expr = NULL;
-                string_set(&p->label, NULL);
-                string_set(&p->format, NULL);
-                p->next = free_ents; /* save [struct ent] for reuse */
-                free_ents = p;
+    int b, t, i, c, nbands = (sp->maxrows + TILE_ROWS - 1) >> TILE_ROWS_SHIFT;
+    entarena_t cells;
+    scstats_t stats;
+
+    /* only scan the allocated bands and tiles */
+    for (b = 0; sp->tbl && b < nbands; b++) {
+        cellband_t *bp = sp->tbl[b];
+        if (!bp) continue;
+        for (t = 0; t < TILE_NCOLS; t++) {
+            celltile_t *tp = bp->tiles[t];
+            struct ent **pp;
+            if (!tp) continue;
+            for (i = 0, pp = &tp->cp[0][0]; i < TILE_COLS * TILE_ROWS; i++, pp++) {
+                // XXX: should factorize as erasecell()
+                struct ent *p = *pp;
+                if (p) {
+                    *pp = NULL;
+                    efree(p->expr);
+                    ent_clear_value(p);
+                    ent_set_format(p, NULL);
+                }
             }
         }
     }
     /* free all sheet data */
-    for (r = 0; r < sp->maxrows; r++) {
-        scxfree(sp->tbl[r].cp);
-    }
-    scxfree(sp->tbl);
+    depgraph_invalidate(sp);
+    lookup_cache_free(sp);
+    crit_cache_free(sp);
+    colmirror_free(sp);
+    tbl_free(sp);
+    ent_arena_free(sp);
     scxfree(sp->rowfmt);
     scxfree(sp->colfmt);
-    sp->tbl = NULL;
     sp->rowfmt = NULL;
     sp->colfmt = NULL;
 
@@ -1854,7 +2006,11 @@ void erasedb(sheet_t *sp) {
     }
     qbuf = 0;
 
+    cells = sp->cells;
+    stats = sp->stats;
     sheet_init(sp);
+    sp->cells = cells;
+    sp->stats = stats;
 
     FullUpdate++;
 }
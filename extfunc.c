@@ -0,0 +1,379 @@
+/*      SC      A Spreadsheet Calculator
+ *              External function commands
+ *
+ *              The commands run by @ext() are cached by command line.
+ *              A result is reused by every formula evaluated in the
+ *              recalc that follows its arrival and for `extttl`
+ *              seconds after it.  Missing or expired results are
+ *              queued and run by a pool of at most `extjobs` child
+ *              processes, each one killed after `exttimeout` seconds.
+ *              The formulas keep their previous value until the new
+ *              result arrives, then the sheet is recalculated.
+ *
+ *              $Revision: 9.1 $
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "sc.h"
+
+#define EXT_MAXJOBS  64
+
+void set_extjobs(sheet_t *sp, int n) {
+    if (n < 1 || n > EXT_MAXJOBS) {
+        error("external job count must be between 1 and %d", EXT_MAXJOBS);
+        n = n < 1 ? 1 : EXT_MAXJOBS;
+    }
+    sp->extjobs = n;
+}
+
+void set_exttimeout(sheet_t *sp, int n) {
+    sp->exttimeout = n < 0 ? 0 : n;
+}
+
+void set_extttl(sheet_t *sp, int n) {
+    sp->extttl = n < 0 ? 0 : n;
+}
+
+#ifndef NOEXTFUNCS
+
+#define EXT_HASH_SIZE  1024
+#define EXT_CACHE_MAX  8192
+
+enum { EXT_IDLE, EXT_QUEUED, EXT_RUNNING, EXT_DONE };
+
+typedef struct extcmd {
+    struct extcmd *next;        /* hash chain */
+    struct extcmd *qnext;       /* run queue */
+    SCXMEM string_t *cmd;
+    SCXMEM string_t *result;    /* first output line or NULL on error */
+    unsigned int hash;
+    int state;
+    int err;                    /* error of the last run */
+    int gen;                    /* last recalc the result is current for */
+    int lastuse;                /* last recalc that asked for the result */
+    double stamp;               /* arrival time of the result */
+} extcmd_t;
+
+typedef struct extjob {
+    extcmd_t *cmd;              /* command waiting for its output or NULL */
+    pid_t pid;                  /* running child or 0 */
+    int fd;                     /* read end of the output pipe or -1 */
+    int len;
+    double deadline;            /* time to kill the child or 0 */
+    char buf[FBUFLEN];
+} extjob_t;
+
+static struct ext_pool {
+    SCXMEM extcmd_t *hash[EXT_HASH_SIZE];
+    int count;                  /* number of cached commands */
+    extcmd_t *qhead, *qtail;    /* commands waiting for a job */
+    int njobs;                  /* number of running children */
+    int gen;                    /* recalc generation */
+    int arrived;                /* number of results received */
+    extjob_t jobs[EXT_MAXJOBS];
+} ext;
+
+static unsigned int ext_hash(const char *s) {
+    unsigned int h = 2166136261U;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619U;
+    return h;
+}
+
+static void ext_free(extcmd_t *ep) {
+    string_free(ep->cmd);
+    string_free(ep->result);
+    scxfree(ep);
+}
+
+/* drop the cached results that were not used by the current recalc */
+static void ext_purge(void) {
+    extcmd_t **pp, *ep;
+    int i;
+
+    for (i = 0; i < EXT_HASH_SIZE; i++) {
+        for (pp = &ext.hash[i]; (ep = *pp) != NULL;) {
+            if ((ep->state == EXT_IDLE || ep->state == EXT_DONE)
+            &&  ep->lastuse != ext.gen) {
+                *pp = ep->next;
+                ext_free(ep);
+                ext.count--;
+            } else {
+                pp = &ep->next;
+            }
+        }
+    }
+}
+
+/* a result arrived or the command failed: it is current until the
+   end of the next recalc, which is triggered by its arrival */
+static void ext_done(extcmd_t *ep, SCXMEM string_t *result, int err) {
+    string_set(&ep->result, result);
+    ep->err = err;
+    ep->state = EXT_DONE;
+    ep->gen = ext.gen + 1;
+    ep->stamp = sc_clock();
+    ext.arrived++;
+}
+
+static void ext_deliver(extjob_t *jp) {
+    extcmd_t *ep = jp->cmd;
+    char *p;
+
+    if (jp->fd >= 0) {
+        close(jp->fd);
+        jp->fd = -1;
+    }
+    if (!ep)
+        return;
+    jp->cmd = NULL;
+    jp->buf[jp->len] = '\0';
+    if ((p = strchr(jp->buf, '\n')) != NULL)
+        *p = '\0';
+    if (jp->len == 0) {
+        // XXX: should use the empty string?
+        error("Warning: external function returned nothing");
+    }
+    ext_done(ep, string_new(strtrim(jp->buf)), 0);
+}
+
+static void ext_spawn(sheet_t *sp, extjob_t *jp, extcmd_t *ep) {
+    int pfd[2];
+    pid_t pid;
+
+    if (pipe(pfd) < 0) {
+        error("Warning: running \"%s\" failed", s2c(ep->cmd));
+        ext_done(ep, NULL, ERROR_NA);
+        return;
+    }
+    fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+    fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+    if ((pid = fork()) == 0) {
+        /* run the command in its own process group with no input so
+           a timeout can kill the whole pipeline */
+        int fd = open("/dev/null", O_RDONLY);
+        setpgid(0, 0);
+        if (fd >= 0) dup2(fd, STDIN_FILENO);
+        dup2(pfd[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", s2c(ep->cmd), (char *)NULL);
+        _exit(127);
+    }
+    close(pfd[1]);
+    if (pid < 0) {
+        close(pfd[0]);
+        error("Warning: running \"%s\" failed", s2c(ep->cmd));
+        ext_done(ep, NULL, ERROR_NA);
+        return;
+    }
+    ep->state = EXT_RUNNING;
+    jp->cmd = ep;
+    jp->pid = pid;
+    jp->fd = pfd[0];
+    jp->len = 0;
+    jp->deadline = sp->exttimeout ? sc_clock() + sp->exttimeout : 0;
+    ext.njobs++;
+}
+
+/* start the queued commands while the pool has room */
+static void ext_start(sheet_t *sp) {
+    extjob_t *jp;
+    extcmd_t *ep;
+
+    for (jp = ext.jobs; ext.qhead && ext.njobs < sp->extjobs; jp++) {
+        if (jp->pid)
+            continue;
+        ep = ext.qhead;
+        if (!(ext.qhead = ep->qnext))
+            ext.qtail = NULL;
+        ep->qnext = NULL;
+        ext_spawn(sp, jp, ep);
+    }
+}
+
+static void ext_read(extjob_t *jp) {
+    ssize_t n = read(jp->fd, jp->buf + jp->len, sizeof(jp->buf) - 1 - jp->len);
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n > 0) {
+        jp->len += n;
+        /* only the first line is used */
+        if (!memchr(jp->buf + jp->len - n, '\n', n) && jp->len < (int)sizeof(jp->buf) - 1)
+            return;
+    }
+    ext_deliver(jp);
+}
+
+/* kill the children past their deadline and reap the finished ones */
+static void ext_reap(extjob_t *jp, double now) {
+    int status;
+    pid_t pid;
+
+    if (jp->deadline && now >= jp->deadline) {
+        kill(-jp->pid, SIGKILL);
+        kill(jp->pid, SIGKILL);
+        waitpid(jp->pid, &status, 0);
+        if (jp->cmd) {
+            error("Warning: external function \"%s\" timed out", s2c(jp->cmd->cmd));
+            ext_done(jp->cmd, NULL, ERROR_NA);
+            jp->cmd = NULL;
+        }
+        if (jp->fd >= 0) {
+            close(jp->fd);
+            jp->fd = -1;
+        }
+    } else {
+        /* the output pipe is read until the end before reaping */
+        if (jp->fd >= 0)
+            return;
+        pid = waitpid(jp->pid, &status, WNOHANG);
+        if (pid == 0 || (pid < 0 && errno == EINTR))
+            return;
+    }
+    jp->pid = 0;
+    ext.njobs--;
+}
+
+int ext_pending(void) {
+    return ext.njobs > 0 || ext.qhead != NULL;
+}
+
+/* Wait up to `ms` milliseconds for output from the running commands,
+   return the number of results that arrived.
+ */
+int ext_poll(sheet_t *sp, int ms) {
+    struct pollfd fds[EXT_MAXJOBS];
+    extjob_t *jobs[EXT_MAXJOBS];
+    int i, nfds = 0, arrived = ext.arrived;
+    double now = sc_clock();
+
+    ext_start(sp);
+    for (i = 0; i < EXT_MAXJOBS; i++) {
+        extjob_t *jp = &ext.jobs[i];
+        if (!jp->pid)
+            continue;
+        if (jp->deadline && (jp->deadline - now) * 1000 < ms)
+            ms = (jp->deadline - now) * 1000 + 1;
+        if (jp->fd < 0) {
+            /* poll again soon for the exit of the child */
+            if (ms > 10) ms = 10;
+            continue;
+        }
+        fds[nfds].fd = jp->fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        jobs[nfds++] = jp;
+    }
+    if (ms < 0)
+        ms = 0;
+    if (poll(fds, nfds, ms) > 0) {
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].revents)
+                ext_read(jobs[i]);
+        }
+    }
+    now = sc_clock();
+    for (i = 0; i < EXT_MAXJOBS; i++) {
+        if (ext.jobs[i].pid)
+            ext_reap(&ext.jobs[i], now);
+    }
+    ext_start(sp);
+    return ext.arrived - arrived;
+}
+
+/* wait for all the queued and running commands to complete */
+int ext_wait(sheet_t *sp) {
+    int count = 0;
+
+    while (ext_pending())
+        count += ext_poll(sp, 1000);
+    return count;
+}
+
+/* start a new recalc: results that arrived before the previous one expire */
+void ext_expire(void) {
+    ext.gen++;
+}
+
+/* Return the result of `command` if it is current, otherwise queue the
+   command and return NULL.  `*errp` is set if the last run failed.
+ */
+SCXMEM string_t *ext_result(sheet_t *sp, const char *command, int *errp) {
+    unsigned int h = ext_hash(command);
+    extcmd_t *ep;
+
+    for (ep = ext.hash[h % EXT_HASH_SIZE]; ep; ep = ep->next) {
+        if (ep->hash == h && !strcmp(s2c(ep->cmd), command))
+            break;
+    }
+    if (!ep) {
+        if (ext.count >= EXT_CACHE_MAX)
+            ext_purge();
+        ep = scxmalloc(sizeof(*ep));
+        if (!ep) {
+            *errp = ERROR_MEM;
+            return NULL;
+        }
+        memset(ep, 0, sizeof(*ep));
+        ep->cmd = string_new(command);
+        ep->hash = h;
+        ep->state = EXT_IDLE;
+        ep->next = ext.hash[h % EXT_HASH_SIZE];
+        ext.hash[h % EXT_HASH_SIZE] = ep;
+        ext.count++;
+    }
+    ep->lastuse = ext.gen;
+    if (ep->state == EXT_DONE
+    &&  (ep->gen >= ext.gen || (sp->extttl && sc_clock() - ep->stamp < sp->extttl))) {
+        if (ep->err) {
+            *errp = ep->err;
+            return NULL;
+        }
+        return string_dup(ep->result);
+    }
+    if (ep->state == EXT_IDLE || ep->state == EXT_DONE) {
+        ep->state = EXT_QUEUED;
+        if (ext.qtail)
+            ext.qtail->qnext = ep;
+        else
+            ext.qhead = ep;
+        ext.qtail = ep;
+        ext_start(sp);
+    }
+    return NULL;
+}
+
+/* kill the running commands and free the cache */
+void ext_clean(void) {
+    extjob_t *jp;
+    extcmd_t *ep;
+    int i, status;
+
+    for (jp = ext.jobs; jp < ext.jobs + EXT_MAXJOBS; jp++) {
+        if (jp->pid) {
+            kill(-jp->pid, SIGKILL);
+            kill(jp->pid, SIGKILL);
+            waitpid(jp->pid, &status, 0);
+            if (jp->fd >= 0)
+                close(jp->fd);
+            jp->pid = 0;
+            jp->fd = -1;
+            jp->cmd = NULL;
+        }
+    }
+    ext.njobs = 0;
+    ext.qhead = ext.qtail = NULL;
+    for (i = 0; i < EXT_HASH_SIZE; i++) {
+        while ((ep = ext.hash[i]) != NULL) {
+            ext.hash[i] = ep->next;
+            ext_free(ep);
+        }
+    }
+    ext.count = 0;
+}
+
+#endif  /* NOEXTFUNCS */
@@ -26,6 +26,9 @@ sheet_t *sheet_init(sheet_t *sp) {
     memset(sp, 0, sizeof(*sp));
     sp->autocalc = 1;
     sp->propagation = 10;
+    sp->threads = 1;
+    sp->extjobs = 8;
+    sp->exttimeout = 10;
     sp->calc_order = BYROWS;
     sp->prescale = 1.0;
     sp->showtop = 1;
@@ -46,11 +49,15 @@ static void write_options(sheet_t *sp, FILE *f) {
         !sp->optimize &&
         !sp->rndtoeven &&
         sp->propagation == 10 &&
+        sp->threads == 1 &&
         sp->calc_order == BYROWS &&
         !sp->protect &&
         !sp->numeric &&
         sp->prescale == 1.0 &&
         !sp->extfunc &&
+        sp->extjobs == 8 &&
+        sp->exttimeout == 10 &&
+        !sp->extttl &&
         sp->showtop &&
         !sp->tbl_style &&
         !sp->craction &&
@@ -71,11 +78,15 @@ static void write_options(sheet_t *sp, FILE *f) {
     if (sp->optimize)   fprintf(f," optimize");
     if (sp->rndtoeven)  fprintf(f, " rndtoeven");
     if (sp->propagation != 10)  fprintf(f, " iterations = %d", sp->propagation);
+    if (sp->threads != 1)   fprintf(f, " threads = %d", sp->threads);
     if (sp->calc_order != BYROWS )  fprintf(f, " bycols");
     if (sp->protect)    fprintf(f, " protect");
     if (sp->numeric)    fprintf(f, " numeric");
     if (sp->prescale != 1.0)    fprintf(f, " prescale");
     if (sp->extfunc)    fprintf(f, " extfun");
+    if (sp->extjobs != 8)   fprintf(f, " extjobs = %d", sp->extjobs);
+    if (sp->exttimeout != 10)   fprintf(f, " exttimeout = %d", sp->exttimeout);
+    if (sp->extttl)     fprintf(f, " extttl = %d", sp->extttl);
     if (!sp->showtop)   fprintf(f, " !toprow");
     if (sp->tbl_style) {
         fprintf(f, " tblstyle = %s",
@@ -469,9 +480,9 @@ void write_cells(sheet_t *sp, FILE *f, rangeref_t rr, cellref_t cr, int dcp_flag
                     }
                     fprintf(f, "%s %s\n", command, cell_addr(sp, cellref(row, col)));
                 }
-                if (p->format) {
+                if (p->flags & HAS_FORMAT) {
                     buf_setf(buf, "fmt %s ", cell_addr(sp, cellref(row, col)));
-                    buf_quotestr(buf, '"', s2c(p->format), '"');
+                    buf_quotestr(buf, '"', s2c(ent_format(p)), '"');
                     fprintf(f, "%s\n", buf->buf);
                 }
             }
@@ -487,6 +498,7 @@ int writefile(sheet_t *sp, const char *fname, rangeref_t rr, int dcp_flags) {
     char *ext;
     char *plugin;
     int pid;
+    double start = sc_clock();
 
 #ifndef NOPLUGINS
     /* find the extension and mapped plugin if exists */
@@ -552,6 +564,7 @@ int writefile(sheet_t *sp, const char *fname, rangeref_t rr, int dcp_flags) {
     }
     write_fd(sp, f, rr, dcp_flags);
     closefile(f, pid, 0);
+    sp->stats.save_time = sc_clock() - start;
 
     if (usecurses) {
         error("File \"%s\" written", save);
@@ -573,6 +586,7 @@ int readfile(sheet_t *sp, const char *fname, int eraseflg) {
     char *plugin;
     int pid = 0;
     int rfd = STDOUT_FILENO, savefd;
+    double start = sc_clock();
 
     tempautolabel = autolabel;          /* turn off auto label when */
     autolabel = 0;                      /* reading a file */
@@ -691,6 +705,8 @@ int readfile(sheet_t *sp, const char *fname, int eraseflg) {
         screen_goraw();
     }
     if (eraseflg) {
+        /* time to read the file, the recalc is measured separately */
+        sp->stats.load_time = sc_clock() - start;
         pstrcpy(sp->curfile, sizeof sp->curfile, save);
         sp->modflg = 0;
         if (!sempty(sp->autorun) && !skipautorun)
@@ -96,7 +96,7 @@ static SCXMEM string_t *get_strarg(sheet_t *sp, cellref_t cr) {
 %token <cval> VAR
 %token <sval> WORD PLUGIN
 %token <ival> COL
-%token <ival> FUNC0 FUNC01 FUNC1 FUNC12 FUNC13 FUNC1x FUNC2 FUNC2x FUNC23 FUNC3 FUNC34 FUNC35
+%token <ival> FUNC0 FUNC01 FUNC1 FUNC12 FUNC13 FUNC1x FUNC2 FUNC2x FUNC23 FUNC3 FUNC3x FUNC34 FUNC35
 
 /* command names (one per line for automatic generation of tokens.h) */
 
@@ -203,6 +203,9 @@ static SCXMEM string_t *get_strarg(sheet_t *sp, cellref_t cr) {
 %token S_REDRAW
 %token S_QUIT
 %token S_STATUS
+%token S_CYCLES
+%token S_PROFILE
+%token S_STATS
 %token S_RUN
 %token S_PLUGIN
 %token S_PLUGOUT
@@ -221,10 +224,15 @@ static SCXMEM string_t *get_strarg(sheet_t *sp, cellref_t cr) {
 %token K_BYCOLS
 %token K_OPTIMIZE
 %token K_ITERATIONS
+%token K_THREADS
 %token K_PROTECT
 %token K_NUMERIC
 %token K_PRESCALE
 %token K_EXTFUN
+%token K_EXTJOBS
+%token K_EXTTIMEOUT
+%token K_EXTTTL
+%token K_PROFILE
 %token K_CELLCUR
 %token K_TOPROW
 %token K_COLOR
@@ -495,6 +503,12 @@ command:  S_LET var_or_range '=' e      { let(sht, $2.left, $4, -1); }
         | S_QUERY outfd                 { cmd_query(sht, NULL, NULL, $2); }
         | S_GETKEY outfd                { cmd_getkey(sht, $2); }
         | S_STATUS outfd                { cmd_status(sht, $2); }
+        | S_CYCLES outfd                { cmd_cycles(sht, $2); }
+        | S_STATS outfd                 { cmd_stats(sht, $2); }
+        | S_PROFILE                     { cmd_profile(sht, 0, NULL); }
+        | S_PROFILE NUMBER              { cmd_profile(sht, $2, NULL); }
+        | S_PROFILE STRING              { cmd_profile(sht, 0, $2); }
+        | S_PROFILE NUMBER STRING       { cmd_profile(sht, $2, $3); }
 
         | S_RECALC                      { cmd_recalc(sht); }
         | S_REDRAW                      { cmd_redraw(sht); }
@@ -544,6 +558,7 @@ term:     VAR                           { $$ = new_var(sht, $1); }
         | FUNC23 '(' e ',' e ',' e ')'  { $$ = new_op3($1, $3, $5, $7); }
         | FUNC2x '(' e ',' expr_list ')' { $$ = new_op1x($1, $3, $5); }
         | FUNC3 '(' e ',' e ',' e ')'   { $$ = new_op3($1, $3, $5, $7); }
+        | FUNC3x '(' e ',' e ',' expr_list ')' { $$ = new_op1x($1, $3, new_op2(OP_COMMA_, $5, $7)); }
         | FUNC34 '(' e ',' e ',' e ')'  { $$ = new_op3($1, $3, $5, $7); }
         | FUNC34 '(' e ',' e ',' e ',' e ')' { $$ = new_op1x($1, $3, new_op3(OP_COMMA_, $5, $7, $9)); }
         | FUNC35 '(' e ',' e ',' e ')'  { $$ = new_op3($1, $3, $5, $7); } /* XXX: hack for FV, PMT, PV */
@@ -620,9 +635,14 @@ setitem : not K_AUTO                { set_autocalc(sht, $1); }
         | not K_NUMERIC             { sht->numeric = $1; }
         | not K_OPTIMIZE            { sht->optimize = $1; }
         | not K_PRESCALE            { sht->prescale = $1 ? 0.01 : 1.0; } // XXX: should use 100.0
-        | not K_RNDTOEVEN           { sht->rndtoeven = $1; FullUpdate++; }
+        | not K_RNDTOEVEN           { sht->rndtoeven = $1; depgraph_dirty_all(sht); FullUpdate++; }
         | not K_TOPROW              { sht->showtop = $1; FullUpdate++; }
         | K_ITERATIONS '=' NUMBER   { set_iterations(sht, $3); }
+        | K_THREADS '=' NUMBER      { set_threads(sht, $3); }
+        | K_EXTJOBS '=' NUMBER      { set_extjobs(sht, $3); }
+        | K_EXTTIMEOUT '=' NUMBER   { set_exttimeout(sht, $3); }
+        | K_EXTTTL '=' NUMBER       { set_extttl(sht, $3); }
+        | not K_PROFILE             { set_profile(sht, $1); }
         | K_TBLSTYLE '=' NUMBER     { sht->tbl_style = $3; }
         | K_TBLSTYLE '=' K_TBL      { sht->tbl_style = TBL; }
         | K_TBLSTYLE '=' K_LATEX    { sht->tbl_style = LATEX; }
@@ -637,6 +657,6 @@ setitem : not K_AUTO                { set_autocalc(sht, $1); }
         | not K_BACKUP              { dobackups = $1; }
         | not K_MOUSE               { if ($1) screen_mouseon(); else screen_mouseoff(); }
         | not K_SCRC                { scrc = $1; }
-        | not K_LOCALE              { sc_set_locale($1); FullUpdate++; }
+        | not K_LOCALE              { sc_set_locale($1); depgraph_dirty_all(sht); FullUpdate++; }
         | not K_EMACS               { emacs_bindings = $1; }
         ;
@@ -0,0 +1,827 @@
+/*      SC      A Spreadsheet Calculator
+ *              Formula dependency graph
+ *
+ *              The graph links each formula cell to the formula cells
+ *              it references, directly or through a range.  It is
+ *              rebuilt on demand after the cell expressions or their
+ *              positions change and gives EvalAll() an evaluation order
+ *              where every formula is computed after its precedents.
+ *              Value changes mark the formulas that reference the cell
+ *              as dirty so only they and their dependents are evaluated.
+ *              The dirty formulas and the volatile ones (@now, @rand...)
+ *              are listed so a recalc starts from them without visiting
+ *              the other formulas.  An interrupted recalc continues from
+ *              its position in the order, moved back by later changes.
+ *
+ *              References are indexed in a packed R-tree so the formulas
+ *              whose references cover a given cell are found without
+ *              scanning all references or all cells of large ranges.
+ *
+ *              Circular references are found as the strongly connected
+ *              components of the graph, only their cells are iterated.
+ *
+ *              $Revision: 9.1 $
+ */
+
+#include "sc.h"
+
+/* grow a dynamic array of n elements of size `size` to hold one more */
+static int graph_grow(void *pp, int n, int *sizep, size_t size) {
+    void **ptr = pp;
+    if (n >= *sizep) {
+        int newsize = *sizep ? *sizep + (*sizep >> 1) : 64;
+        void *p = scxrealloc(*ptr, newsize * size);
+        if (!p)
+            return 0;
+        *ptr = p;
+        *sizep = newsize;
+    }
+    return 1;
+}
+
+static unsigned int graph_hash(int row, int col) {
+    return (unsigned int)row * 31U + (unsigned int)col * 2654435761U;
+}
+
+/* find the node for the formula at row,col, return -1 if none */
+int depgraph_find(depgraph_t *g, int row, int col) {
+    unsigned int h;
+    int n;
+
+    if (!g->hashsize)
+        return -1;
+    for (h = graph_hash(row, col) & (g->hashsize - 1);
+         (n = g->hash[h]) >= 0;
+         h = (h + 1) & (g->hashsize - 1)) {
+        if (g->nodes[n].row == row && g->nodes[n].col == col)
+            return n;
+    }
+    return -1;
+}
+
+static void graph_hash_add(depgraph_t *g, int n) {
+    unsigned int h = graph_hash(g->nodes[n].row, g->nodes[n].col) & (g->hashsize - 1);
+    while (g->hash[h] >= 0)
+        h = (h + 1) & (g->hashsize - 1);
+    g->hash[h] = n;
+}
+
+/* get the bounding range of a reference known at parse time */
+static int graph_static_range(enode_t *e, rangeref_t *rp) {
+    rangeref_t rr;
+
+    switch (e->type) {
+    case OP_TYPE_VAR:
+        rp->left = rp->right = e->e.cr;
+        return 1;
+    case OP_TYPE_RANGE:
+        *rp = e->e.rr;
+        range_normalize(rp);
+        return 1;
+    case OP_TYPE_FUNC:
+        if (e->op == OP_COLON_
+        &&  graph_static_range(e->e.args[0], rp)
+        &&  graph_static_range(e->e.args[1], &rr)) {
+            if (rp->left.row > rr.left.row) rp->left.row = rr.left.row;
+            if (rp->left.col > rr.left.col) rp->left.col = rr.left.col;
+            if (rp->right.row < rr.right.row) rp->right.row = rr.right.row;
+            if (rp->right.col < rr.right.col) rp->right.col = rr.right.col;
+            return 1;
+        }
+        break;
+    }
+    return 0;
+}
+
+/* collect the static references of expression e into the graph */
+static int graph_add_refs(depgraph_t *g, depnode_t *np, enode_t *e) {
+    rangeref_t rr;
+    int i;
+
+    if (!e)
+        return 1;
+    switch (e->type) {
+    case OP_TYPE_FUNC:
+        switch (e->op) {
+        case OP_COLON_:     /* range spanning both operands */
+            if (graph_static_range(e, &rr))
+                goto addref;
+            np->flags |= DEP_DYNAMIC;
+            break;
+        case OP_INDIRECT:   /* references computed at run time */
+        case OP_NVAL:
+        case OP_SVAL:
+        case OP_NUMITER:    /* value changes from one pass to the next */
+            np->flags |= DEP_DYNAMIC;
+            break;
+        case OP_RAND:       /* value changes from one recalc to the next */
+        case OP_RANDBETWEEN:
+        case OP_NOW:
+        case OP_TODAY:
+        case OP_EXT:
+            np->flags |= DEP_VOLATILE | DEP_SERIAL;
+            break;
+        case OP_ASSERT:     /* reports errors or uses static buffers */
+        case OP_COLTOA:
+        case OP_ADDRESS:
+        case OP_FORMULA:
+        case OP_FORMULATEXT:
+            np->flags |= DEP_SERIAL;
+            break;
+        case OP_LASTROW:
+        case OP_LASTCOL:
+        case OP_FILENAME:
+            np->flags |= DEP_VOLATILE;
+            break;
+        case OP_SUM:        /* use the running totals of the columns */
+        case OP_SUMSQ:
+        case OP_COUNT:
+        case OP_COUNTA:
+        case OP_AVERAGE:
+        case OP_AVERAGEA:
+        case OP_AVG:
+        case OP_STDEV:
+        case OP_STDEVA:
+        case OP_STDEVP:
+        case OP_STDEVPA:
+        case OP_VAR:
+        case OP_VARA:
+        case OP_VARP:
+        case OP_VARPA:
+            np->flags |= DEP_TOTALS;
+            break;
+        case OP_LOOKUP:     /* build the hash index of the table */
+        case OP_MATCH:
+        case OP_VLOOKUP:
+            np->flags |= DEP_LOOKUP;
+            break;
+        case OP_COUNTIF:    /* share the match bitmaps of the criteria */
+        case OP_COUNTIFS:
+        case OP_SUMIF:
+        case OP_SUMIFS:
+        case OP_AVERAGEIF:
+        case OP_AVERAGEIFS:
+        case OP_MAXIFS:
+        case OP_MINIFS:
+        case OP_DAVERAGE:
+        case OP_DCOUNT:
+        case OP_DCOUNTA:
+        case OP_DGET:
+        case OP_DMAX:
+        case OP_DMIN:
+        case OP_DPRODUCT:
+        case OP_DSTDEV:
+        case OP_DSTDEVP:
+        case OP_DSUM:
+        case OP_DVAR:
+        case OP_DVARP:
+            np->flags |= DEP_CRITERIA;
+            break;
+        }
+        for (i = 0; i < e->nargs; i++) {
+            if (!graph_add_refs(g, np, e->e.args[i]))
+                return 0;
+        }
+        return 1;
+    case OP_TYPE_VAR:
+        rr.left = rr.right = e->e.cr;
+        break;
+    case OP_TYPE_RANGE:
+        rr = e->e.rr;
+        range_normalize(&rr);
+        break;
+    default:
+        return 1;
+    }
+addref:
+    if (!graph_grow(&g->refs, g->nrefs, &g->refsize, sizeof(*g->refs)))
+        return 0;
+    g->refs[g->nrefs].rr = rr;
+    g->refs[g->nrefs].node = np - g->nodes;
+    g->nrefs++;
+    np->nrefs++;
+    return 1;
+}
+
+static int graph_add_node(depgraph_t *g, struct ent *p, int row, int col) {
+    depnode_t *np;
+
+    if (!graph_grow(&g->nodes, g->nnodes, &g->nodesize, sizeof(*g->nodes)))
+        return 0;
+    np = &g->nodes[g->nnodes++];
+    np->p = p;
+    np->row = row;
+    np->col = col;
+    np->refs = g->nrefs;
+    np->nrefs = 0;
+    np->deps = np->ndeps = 0;
+    np->flags = 0;
+    return graph_add_refs(g, np, p->expr);
+}
+
+/*---------------- reference index ----------------*/
+
+/* The references are sorted with the Sort-Tile-Recursive method: by
+   row, then by column in vertical slices, and grouped by RTREE_FANOUT.
+   Each level of the tree holds the bounding boxes of groups of
+   RTREE_FANOUT entries of the level below.  Level 0 is the sorted
+   copy of the reference list g->rtleaf.
+ */
+
+typedef struct rtsort {
+    int row, col;   /* twice the center of the reference */
+    int ref;
+} rtsort_t;
+
+static int rtsort_cmp_row(const void *a, const void *b) {
+    const rtsort_t *x = a, *y = b;
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+static int rtsort_cmp_col(const void *a, const void *b) {
+    const rtsort_t *x = a, *y = b;
+    return (x->col > y->col) - (x->col < y->col);
+}
+
+static void rtree_union(rangeref_t *bp, const rangeref_t *rp) {
+    if (bp->left.row > rp->left.row) bp->left.row = rp->left.row;
+    if (bp->left.col > rp->left.col) bp->left.col = rp->left.col;
+    if (bp->right.row < rp->right.row) bp->right.row = rp->right.row;
+    if (bp->right.col < rp->right.col) bp->right.col = rp->right.col;
+}
+
+static int rtree_build(depgraph_t *g) {
+    SCXMEM rtsort_t *tmp;
+    int i, j, k, n = g->nrefs, leaves, slices, total;
+
+    if (!n)
+        return 1;
+    g->rtleaf = scxmalloc(n * sizeof(*g->rtleaf));
+    tmp = scxmalloc(n * sizeof(*tmp));
+    if (!g->rtleaf || !tmp) {
+        scxfree(tmp);
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        rangeref_t *rp = &g->refs[i].rr;
+        tmp[i].row = rp->left.row + rp->right.row;
+        tmp[i].col = rp->left.col + rp->right.col;
+        tmp[i].ref = i;
+    }
+    qsort(tmp, n, sizeof(*tmp), rtsort_cmp_row);
+    leaves = (n + RTREE_FANOUT - 1) / RTREE_FANOUT;
+    for (slices = 1; slices * slices < leaves; slices++)
+        continue;
+    for (i = 0; i < n; i += slices * RTREE_FANOUT) {
+        k = n - i < slices * RTREE_FANOUT ? n - i : slices * RTREE_FANOUT;
+        qsort(tmp + i, k, sizeof(*tmp), rtsort_cmp_col);
+    }
+    for (i = 0; i < n; i++)
+        g->rtleaf[i] = g->refs[tmp[i].ref];
+    scxfree(tmp);
+
+    /* compute the level sizes, then the bounding boxes bottom up */
+    g->rtcount[0] = n;
+    total = 0;
+    for (k = 1; g->rtcount[k - 1] > 1 || k == 1; k++) {
+        g->rtcount[k] = (g->rtcount[k - 1] + RTREE_FANOUT - 1) / RTREE_FANOUT;
+        g->rtlevel[k] = total;
+        total += g->rtcount[k];
+    }
+    g->rtlevels = k;
+    g->rtbox = scxmalloc(total * sizeof(*g->rtbox));
+    if (!g->rtbox)
+        return 0;
+    for (k = 1; k < g->rtlevels; k++) {
+        for (j = 0; j < g->rtcount[k]; j++) {
+            rangeref_t *bp = &g->rtbox[g->rtlevel[k] + j];
+            int first = j * RTREE_FANOUT;
+            int last = first + RTREE_FANOUT;
+            if (last > g->rtcount[k - 1])
+                last = g->rtcount[k - 1];
+            for (i = first; i < last; i++) {
+                const rangeref_t *rp = (k == 1) ? &g->rtleaf[i].rr :
+                    &g->rtbox[g->rtlevel[k - 1] + i];
+                if (i == first)
+                    *bp = *rp;
+                else
+                    rtree_union(bp, rp);
+            }
+        }
+    }
+    return 1;
+}
+
+static inline int rtree_covers(const rangeref_t *rp, int row, int col) {
+    return (row >= rp->left.row && row <= rp->right.row
+        &&  col >= rp->left.col && col <= rp->right.col);
+}
+
+static void rtree_visit(depgraph_t *g, int level, int j, int row, int col,
+                        void (*fun)(depgraph_t *g, int node, void *arg), void *arg)
+{
+    int i, last;
+
+    if (!rtree_covers(&g->rtbox[g->rtlevel[level] + j], row, col))
+        return;
+    last = (j + 1) * RTREE_FANOUT;
+    if (last > g->rtcount[level - 1])
+        last = g->rtcount[level - 1];
+    if (level == 1) {
+        for (i = j * RTREE_FANOUT; i < last; i++) {
+            if (rtree_covers(&g->rtleaf[i].rr, row, col))
+                fun(g, g->rtleaf[i].node, arg);
+        }
+    } else {
+        for (i = j * RTREE_FANOUT; i < last; i++)
+            rtree_visit(g, level - 1, i, row, col, fun, arg);
+    }
+}
+
+/* call fun(g, node, arg) for each reference that covers cell row,col,
+   node is the formula holding the reference.
+ */
+static void rtree_find(depgraph_t *g, int row, int col,
+                       void (*fun)(depgraph_t *g, int node, void *arg), void *arg)
+{
+    if (g->nrefs)
+        rtree_visit(g, g->rtlevels - 1, 0, row, col, fun, arg);
+}
+
+/*---------------- graph construction ----------------*/
+
+static void graph_count_edge(depgraph_t *g, int node, void *arg) {
+    (void)node;
+    g->nodes[*(int *)arg].ndeps++;
+}
+
+static void graph_store_edge(depgraph_t *g, int node, void *arg) {
+    g->deps[(*(int *)arg)++] = node;
+}
+
+/* build the dependent lists in compressed form: the dependents of
+   node n are deps[nodes[n].deps] .. deps[nodes[n].deps + nodes[n].ndeps - 1]
+ */
+static int graph_link(depgraph_t *g) {
+    int n, total = 0;
+
+    for (n = 0; n < g->nnodes; n++) {
+        depnode_t *np = &g->nodes[n];
+        rtree_find(g, np->row, np->col, graph_count_edge, &n);
+    }
+    for (n = 0; n < g->nnodes; n++) {
+        g->nodes[n].deps = total;
+        total += g->nodes[n].ndeps;
+    }
+    g->nedges = total;
+    g->deps = scxmalloc((total + 1) * sizeof(*g->deps));
+    if (!g->deps)
+        return 0;
+    for (n = 0; n < g->nnodes; n++) {
+        depnode_t *np = &g->nodes[n];
+        int fill = np->deps;
+        rtree_find(g, np->row, np->col, graph_store_edge, &fill);
+    }
+    return 1;
+}
+
+/* compute the evaluation order with Kahn's algorithm.  Nodes are
+   taken in calc_order order among those that are ready.  Nodes with
+   dynamic references, on a cycle or depending on such nodes are left
+   out and listed in g->rest to be iterated.
+   The order is then grouped by level: the level of a node is the length
+   of the longest path from a node without precedents, so the nodes of
+   a level only depend on nodes of lower levels and can be evaluated
+   concurrently.
+ */
+static int graph_sort(depgraph_t *g) {
+    SCXMEM int *indegree;
+    SCXMEM int *level;
+    int n, i, head, tail;
+
+    g->order = scxmalloc((g->nnodes + 1) * sizeof(*g->order));
+    g->rest = scxmalloc((g->nnodes + 1) * sizeof(*g->rest));
+    indegree = scxmalloc((g->nnodes + 1) * sizeof(*indegree));
+    level = scxmalloc((g->nnodes + 1) * sizeof(*level));
+    if (!g->order || !g->rest || !indegree || !level) {
+        scxfree(indegree);
+        scxfree(level);
+        return 0;
+    }
+    memset(indegree, 0, (g->nnodes + 1) * sizeof(*indegree));
+    memset(level, 0, (g->nnodes + 1) * sizeof(*level));
+    for (i = 0; i < g->nedges; i++)
+        indegree[g->deps[i]]++;
+
+    /* g->order is used as the queue of ready nodes */
+    head = tail = 0;
+    for (n = 0; n < g->nnodes; n++) {
+        if (!indegree[n] && !(g->nodes[n].flags & DEP_DYNAMIC))
+            g->order[tail++] = n;
+    }
+    g->nlevels = 0;
+    while (head < tail) {
+        int lev = level[g->order[head]];
+        depnode_t *np = &g->nodes[g->order[head++]];
+        np->flags |= DEP_ORDERED;
+        if (g->nlevels <= lev)
+            g->nlevels = lev + 1;
+        for (i = 0; i < np->ndeps; i++) {
+            int d = g->deps[np->deps + i];
+            if (level[d] <= lev)
+                level[d] = lev + 1;
+            if (!--indegree[d] && !(g->nodes[d].flags & DEP_DYNAMIC))
+                g->order[tail++] = d;
+        }
+    }
+    g->norder = tail;
+    g->nrest = 0;
+    for (n = 0; n < g->nnodes; n++) {
+        if (!(g->nodes[n].flags & DEP_ORDERED))
+            g->rest[g->nrest++] = n;
+    }
+
+    /* stable counting sort of the order by level, indegree is no
+       longer needed and holds a copy of the order.
+     */
+    g->levels = scxmalloc((g->nlevels + 1) * sizeof(*g->levels));
+    if (!g->levels) {
+        scxfree(indegree);
+        scxfree(level);
+        return 0;
+    }
+    memset(g->levels, 0, (g->nlevels + 1) * sizeof(*g->levels));
+    for (i = 0; i < g->norder; i++)
+        g->levels[level[g->order[i]] + 1]++;
+    for (i = 0; i < g->nlevels; i++)
+        g->levels[i + 1] += g->levels[i];
+    memcpy(indegree, g->order, g->norder * sizeof(*g->order));
+    for (i = 0; i < g->norder; i++) {
+        n = indegree[i];
+        g->order[g->levels[level[n]]++] = n;
+    }
+    for (i = g->nlevels; i > 0; i--)
+        g->levels[i] = g->levels[i - 1];
+    g->levels[0] = 0;
+    /* level stores the position of each node in the order */
+    g->pos = level;
+    for (n = 0; n < g->nnodes; n++)
+        level[n] = -1;
+    for (i = 0; i < g->norder; i++)
+        level[g->order[i]] = i;
+    scxfree(indegree);
+    return 1;
+}
+
+static int graph_cmp_int(const void *a, const void *b) {
+    const int *pa = a, *pb = b;
+    return (*pa > *pb) - (*pa < *pb);
+}
+
+/* split the nodes that could not be ordered with Tarjan's algorithm.
+   The nodes with dynamic references and their dependents go at the
+   end of g->rest, they are iterated as a whole because their precedents
+   are unknown.  The others are grouped in strongly connected components
+   listed in evaluation order in g->blocks: a component of more than one
+   node or with a self reference is a cycle that is iterated on its own,
+   the other nodes are evaluated once, after the cycles they depend on.
+ */
+static int graph_cycles(depgraph_t *g) {
+    SCXMEM int *work;
+    int *index, *low, *mark, *stack, *fnode, *fedge, *comp, *cstart;
+    int i, n, v, w, nr, idx, sp, fp, nout, ncomp, pos;
+
+    g->nblocks = 0;
+    g->ndynamic = 0;
+    if (!g->nrest)
+        return 1;
+    nr = g->nnodes + 1;
+    work = scxmalloc(8 * nr * sizeof(*work));
+    g->blocks = scxmalloc((g->nrest + 1) * sizeof(*g->blocks));
+    if (!work || !g->blocks) {
+        scxfree(work);
+        return 0;
+    }
+    index = work;
+    low = index + nr;
+    mark = low + nr;        /* 1: dynamic, 2: on the stack */
+    stack = mark + nr;
+    fnode = stack + nr;     /* depth first search frames */
+    fedge = fnode + nr;
+    comp = fedge + nr;      /* components in reverse evaluation order */
+    cstart = comp + nr;     /* start of each component in comp */
+    for (n = 0; n < g->nnodes; n++) {
+        index[n] = -1;
+        mark[n] = 0;
+    }
+
+    /* mark the dynamic nodes and their dependents */
+    for (i = sp = 0; i < g->nrest; i++) {
+        n = g->rest[i];
+        if (g->nodes[n].flags & DEP_DYNAMIC) {
+            mark[n] = 1;
+            stack[sp++] = n;
+        }
+    }
+    while (sp > 0) {
+        depnode_t *np = &g->nodes[stack[--sp]];
+        for (i = 0; i < np->ndeps; i++) {
+            w = g->deps[np->deps + i];
+            if (!mark[w]) {
+                mark[w] = 1;
+                stack[sp++] = w;
+            }
+        }
+    }
+
+    idx = sp = nout = ncomp = 0;
+    for (i = 0; i < g->nrest; i++) {
+        n = g->rest[i];
+        if (mark[n] || index[n] >= 0)
+            continue;
+        index[n] = low[n] = idx++;
+        stack[sp++] = n;
+        mark[n] = 2;
+        fnode[0] = n;
+        fedge[0] = 0;
+        fp = 1;
+        while (fp > 0) {
+            depnode_t *np = &g->nodes[v = fnode[fp - 1]];
+            if (fedge[fp - 1] < np->ndeps) {
+                w = g->deps[np->deps + fedge[fp - 1]++];
+                if (index[w] < 0 && !mark[w]) {
+                    index[w] = low[w] = idx++;
+                    stack[sp++] = w;
+                    mark[w] = 2;
+                    fnode[fp] = w;
+                    fedge[fp] = 0;
+                    fp++;
+                } else
+                if (mark[w] == 2 && low[v] > index[w]) {
+                    low[v] = index[w];
+                }
+                continue;
+            }
+            if (--fp > 0 && low[fnode[fp - 1]] > low[v])
+                low[fnode[fp - 1]] = low[v];
+            if (low[v] == index[v]) {
+                /* pop the component, sorted in calc_order order */
+                int start = nout;
+                do {
+                    w = stack[--sp];
+                    mark[w] = 0;
+                    comp[nout++] = w;
+                } while (w != v);
+                qsort(comp + start, nout - start, sizeof(*comp), graph_cmp_int);
+                if (nout - start > 1) {
+                    for (w = start; w < nout; w++)
+                        g->nodes[comp[w]].flags |= DEP_CYCLE;
+                } else {
+                    for (w = 0; w < np->ndeps; w++) {
+                        if (g->deps[np->deps + w] == v)
+                            np->flags |= DEP_CYCLE;
+                    }
+                }
+                cstart[ncomp++] = start;
+            }
+        }
+    }
+
+    /* rebuild g->rest: the components in evaluation order, then the
+       dynamic nodes in calc_order order.
+     */
+    for (i = 0; i < g->nrest; i++) {
+        if (mark[g->rest[i]] == 1)
+            stack[g->ndynamic++] = g->rest[i];
+    }
+    cstart[ncomp] = nout;
+    for (pos = 0; ncomp-- > 0;) {
+        g->blocks[g->nblocks++] = pos;
+        for (i = cstart[ncomp]; i < cstart[ncomp + 1]; i++)
+            g->rest[pos++] = comp[i];
+    }
+    g->blocks[g->nblocks] = pos;
+    memcpy(g->rest + pos, stack, g->ndynamic * sizeof(*stack));
+    scxfree(work);
+    return 1;
+}
+
+/* list the volatile nodes, the starting points of the recalc */
+static int graph_volatiles(depgraph_t *g) {
+    int n;
+
+    for (n = 0; n < g->nnodes; n++) {
+        if (g->nodes[n].flags & DEP_VOLATILE)
+            g->nvolatile++;
+    }
+    if (g->nvolatile && !(g->volatiles = scxmalloc(g->nvolatile * sizeof(*g->volatiles))))
+        return 0;
+    g->nvolatile = 0;
+    for (n = 0; n < g->nnodes; n++) {
+        if (g->nodes[n].flags & DEP_VOLATILE)
+            g->volatiles[g->nvolatile++] = n;
+    }
+    return 1;
+}
+
+static void graph_delete(SCXMEM depgraph_t *g) {
+    if (g) {
+        scxfree(g->nodes);
+        scxfree(g->refs);
+        scxfree(g->deps);
+        scxfree(g->hash);
+        scxfree(g->rtleaf);
+        scxfree(g->rtbox);
+        scxfree(g->order);
+        scxfree(g->pos);
+        scxfree(g->volatiles);
+        scxfree(g->dirty);
+        scxfree(g->levels);
+        scxfree(g->rest);
+        scxfree(g->blocks);
+        scxfree(g);
+    }
+}
+
+static void graph_mark_dirty(depgraph_t *g, int node, void *arg) {
+    (void)arg;
+    if (g->pending) {
+        /* continue the interrupted recalc from the changed formulas */
+        int pos = g->pos[node];
+        if (pos >= 0 && pos < g->next)
+            g->next = pos;
+        g->nextblock = 0;
+    }
+    if (!(g->nodes[node].flags & DEP_DIRTY)) {
+        g->nodes[node].flags |= DEP_DIRTY;
+        /* remember the node to start the recalc from it */
+        if (graph_grow(&g->dirty, g->ndirty, &g->dirtysize, sizeof(*g->dirty)))
+            g->dirty[g->ndirty++] = node;
+        else
+            g->full = 1;
+    }
+}
+
+static SCXMEM depgraph_t *graph_build(sheet_t *sp) {
+    SCXMEM depgraph_t *g;
+    struct ent *p;
+    int r, c, n;
+
+    g = scxmalloc(sizeof(*g));
+    if (!g)
+        return NULL;
+    memset(g, 0, sizeof(*g));
+    g->full = 1;
+
+    if (sp->calc_order == BYCOLS) {
+        for (c = 0; c <= sp->maxcol; c++) {
+            for (r = 0; r <= sp->maxrow; r++) {
+                if ((p = getcell(sp, r, c)) && p->expr && !graph_add_node(g, p, r, c))
+                    goto fail;
+            }
+        }
+    } else {
+        for (r = 0; r <= sp->maxrow; r++) {
+            for (c = 0; c <= sp->maxcol; c++) {
+                if ((p = getcell(sp, r, c)) && p->expr && !graph_add_node(g, p, r, c))
+                    goto fail;
+            }
+        }
+    }
+    if (!g->nnodes)
+        goto done;
+
+    for (g->hashsize = 16; g->hashsize < g->nnodes * 2; g->hashsize *= 2)
+        continue;
+    g->hash = scxmalloc(g->hashsize * sizeof(*g->hash));
+    if (!g->hash)
+        goto fail;
+    memset(g->hash, -1, g->hashsize * sizeof(*g->hash));
+    for (n = 0; n < g->nnodes; n++)
+        graph_hash_add(g, n);
+
+    if (!(rtree_build(g) && graph_link(g) && graph_sort(g) && graph_cycles(g)
+    &&    graph_volatiles(g)))
+        goto fail;
+
+done:
+    if (sp->nedits) {
+        /* the other formulas are up to date: only evaluate the edited
+           cells and their dependents */
+        g->full = 0;
+        for (n = 0; n < sp->nedits; n++) {
+            r = depgraph_find(g, sp->edits[n].row, sp->edits[n].col);
+            if (r >= 0)
+                graph_mark_dirty(g, r, NULL);
+            if (g->nnodes)
+                rtree_find(g, sp->edits[n].row, sp->edits[n].col, graph_mark_dirty, NULL);
+        }
+        sp->nedits = 0;
+    }
+    return g;
+
+fail:
+    graph_delete(g);
+    return NULL;
+}
+
+/* return the dependency graph of the sheet, building it if needed.
+   Return NULL if memory is exhausted.
+ */
+depgraph_t *depgraph_get(sheet_t *sp) {
+    if (!sp->graph)
+        sp->graph = graph_build(sp);
+    return sp->graph;
+}
+
+static int graph_edit_add(sheet_t *sp, int row, int col) {
+    if (!graph_grow(&sp->edits, sp->nedits, &sp->editsize, sizeof(*sp->edits)))
+        return 0;
+    sp->edits[sp->nedits++] = cellref(row, col);
+    return 1;
+}
+
+/* mark the formulas that reference cell row,col for evaluation after
+   a change of its value outside of the recalc.
+ */
+void depgraph_dirty(sheet_t *sp, int row, int col) {
+    depgraph_t *g = sp->graph;
+
+    if (g && (!g->full || g->pending))
+        rtree_find(g, row, col, graph_mark_dirty, NULL);
+    else
+    if (!g && sp->nedits && !graph_edit_add(sp, row, col))
+        depgraph_invalidate(sp);
+}
+
+/* request the evaluation of all formulas on the next recalc */
+void depgraph_dirty_all(sheet_t *sp) {
+    depgraph_t *g = sp->graph;
+
+    if (g) {
+        g->full = 1;
+        g->next = g->nextblock = 0;
+    }
+    sp->nedits = 0;
+}
+
+/* a recalc was interrupted and must be continued */
+int depgraph_pending(sheet_t *sp) {
+    return sp->graph && sp->graph->pending;
+}
+
+/* the value of formula cell row,col may change when the interrupted
+   recalc is continued: the formulas not reached yet are stale, as are
+   the ones that cannot be ordered until the recalc completes.
+ */
+int depgraph_stale(sheet_t *sp, int row, int col) {
+    depgraph_t *g = sp->graph;
+    int node;
+
+    if (!g || !g->pending || (node = depgraph_find(g, row, col)) < 0)
+        return 0;
+    return g->pos[node] < 0 || g->pos[node] >= g->next;
+}
+
+/* discard the graph after a change to the cell expressions or positions */
+void depgraph_invalidate(sheet_t *sp) {
+    if (sp->graph) {
+        graph_delete(sp->graph);
+        sp->graph = NULL;
+    }
+    scxfree(sp->edits);
+    sp->edits = NULL;
+    sp->nedits = sp->editsize = 0;
+}
+
+/* the formula of cell row,col changed: the graph is rebuilt on the next
+   recalc, but if the other formulas are up to date, only the cell and
+   its dependents are evaluated.
+ */
+void depgraph_edit(sheet_t *sp, int row, int col) {
+    depgraph_t *g = sp->graph;
+    int i;
+
+    if (g) {
+        if (g->full || g->pending) {
+            depgraph_invalidate(sp);
+            return;
+        }
+        /* keep the formulas marked since the last recalc */
+        for (i = 0; i < g->ndirty; i++) {
+            depnode_t *np = &g->nodes[g->dirty[i]];
+            if ((np->flags & DEP_DIRTY) && !graph_edit_add(sp, np->row, np->col)) {
+                depgraph_invalidate(sp);
+                return;
+            }
+        }
+        graph_delete(g);
+        sp->graph = NULL;
+    } else
+    if (!sp->nedits) {
+        /* all formulas will be evaluated */
+        return;
+    }
+    if (!graph_edit_add(sp, row, col))
+        depgraph_invalidate(sp);
+}
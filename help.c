@@ -75,6 +75,7 @@ static const char * const setoptions[] = {
 "          bycols        Recalculate in column order.",
 "          optimize      Optimize expressions upon entry. (default off)",
 "          iterations=n  Set the number of iterations allowed. (10)",
+"          threads=n     Set the number of threads used for recalc. (1)",
 "          tblstyle=xx   Set ``T'' output style to:",
 "                        0 (none), tex, latex, slatex, or tbl.",
 "          rndtoeven     Round *.5 to nearest even number instead of",
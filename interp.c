@@ -20,16 +20,25 @@
 #endif
 
 #include <math.h>
+#include <fenv.h>
 #include <signal.h>
-#include <setjmp.h>
 #include <time.h>
 
 #include "sc.h"
 
-static jmp_buf fpe_save;
+#ifdef SC_THREADS
+#include <pthread.h>
+#endif
+
+/* floating point faults are detected from the exception flags after
+   each formula instead of trapping SIGFPE: the flags are per thread.
+ */
+#if defined(FE_DIVBYZERO) && defined(FE_INVALID) && defined(FE_OVERFLOW)
+#define FE_EVAL  (FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW)
+#else
+#define FE_EVAL  0
+#endif
 int loading = 0;        /* Set when readfile() is active */
-static int repct = 1;   /* Make repct a global variable so that the
-                           function @numiter can access it */
 
 const char * const error_name[] = {
     NULL,
@@ -50,16 +59,16 @@ const char * const boolean_name[] = {
 };
 
 static SCXMEM enode_t *new_node(int op, int nargs);
+static size_t enode_size(int nargs);
 extern scvalue_t eval_node(eval_ctx_t *cp, enode_t *e);
 extern scvalue_t eval_node_value(eval_ctx_t *cp, enode_t *e);
 static scvalue_t scvalue_getcell(eval_ctx_t *cp, int row, int col);
-static int RealEvalAll(sheet_t *sp);
-static int RealEvalOne(sheet_t *sp, struct ent *p, enode_t *e, int i, int j);
+static int RealEvalAll(sheet_t *sp, depgraph_t *g, int numiter);
+static int RealEvalOne(sheet_t *sp, struct ent *p, enode_t *e, int i, int j, int numiter);
 
 #ifdef RINT
 double rint(double d);
 #endif
-static sigret_t eval_fpe(int n);
 
 #ifndef M_PI
 #define M_PI (double)3.14159265358979323846
@@ -85,11 +94,24 @@ static double math_percent(double x) { return x / 100; }
 
 /*---------------- utility functions ----------------*/
 
+/* String values are normally owned, but values read from cells and
+   string constants only borrow the string: it stays valid for the
+   duration of the evaluation and must not be freed.  Ownership is taken
+   with scvalue_own() when a value escapes into a result.
+ */
 static inline void scvalue_free(scvalue_t v) {
-    if (v.type == SC_STRING)
+    if (v.type == SC_STRING && !v.borrowed)
         string_free(v.u.str);
 }
 
+static inline scvalue_t scvalue_own(scvalue_t v) {
+    if (v.type == SC_STRING && v.borrowed) {
+        string_dup(v.u.str);
+        v.borrowed = 0;
+    }
+    return v;
+}
+
 static inline scvalue_t scvalue_empty(void) {
     scvalue_t res;
     res.type = SC_EMPTY;
@@ -122,6 +144,7 @@ static inline scvalue_t scvalue_string(SCXMEM string_t *str) {
     if (str) {
         res.type = SC_STRING;
         res.u.str = str;
+        res.borrowed = 0;
     } else {
         res.type = SC_ERROR;
         res.u.error = ERROR_MEM;
@@ -129,6 +152,14 @@ static inline scvalue_t scvalue_string(SCXMEM string_t *str) {
     return res;
 }
 
+static inline scvalue_t scvalue_string_ref(string_t *str) {
+    scvalue_t res;
+    res.type = SC_STRING;
+    res.u.str = str;
+    res.borrowed = 1;
+    return res;
+}
+
 static inline scvalue_t scvalue_range(rangeref_t rr) {
     scvalue_t res;
     res.type = SC_RANGE;
@@ -145,11 +176,11 @@ static scvalue_t eval__number(eval_ctx_t *cp, enode_t *e) {
 }
 
 static scvalue_t eval__string(eval_ctx_t *cp, enode_t *e) {
-    return scvalue_string(string_dup(e->e.s));
+    return scvalue_string_ref(e->e.s);
 }
 
-static double eval_num(eval_ctx_t *cp, enode_t *e, int *errp) {
-    scvalue_t res = eval_node_value(cp, e);
+/* convert a value to a number, free it */
+static double scvalue_num(scvalue_t res, int *errp) {
     if (res.type == SC_NUMBER || res.type == SC_BOOLEAN)
         return res.u.v;
     if (res.type == SC_EMPTY)
@@ -159,7 +190,7 @@ static double eval_num(eval_ctx_t *cp, enode_t *e, int *errp) {
         char *end, c;
         double v = strtod(s2c(res.u.str), &end);
         c = *end;
-        string_free(res.u.str);
+        scvalue_free(res);
         if (!c)
             return v;
         *errp = ERROR_VALUE; /* invalid conversion */
@@ -170,6 +201,10 @@ static double eval_num(eval_ctx_t *cp, enode_t *e, int *errp) {
     return 0.0;
 }
 
+static double eval_num(eval_ctx_t *cp, enode_t *e, int *errp) {
+    return scvalue_num(eval_node_value(cp, e), errp);
+}
+
 static int eval_int(eval_ctx_t *cp, enode_t *e, int minvalue, int maxvalue, int *errp) {
     double v = eval_num(cp, e, errp);
     if (!*errp && (v < (double)minvalue || v >= (double)maxvalue + 1.0))
@@ -188,7 +223,7 @@ static SCXMEM string_t *eval_str(eval_ctx_t *cp, enode_t *e, int *errp) {
     char buf[32];
     scvalue_t res = eval_node_value(cp, e);
     if (res.type == SC_STRING)
-        return res.u.str;
+        return scvalue_own(res).u.str;
     if (res.type == SC_NUMBER) {
         int len = snprintf(buf, sizeof buf, "%.15g", res.u.v);
         return string_new_len(buf, len, STRING_ASCII);
@@ -497,6 +532,7 @@ static double fin_pmt(double v1, double v2, double v3) {
 
 /*---------------- range lookup functions ----------------*/
 
+/* get the value of a cell, string values borrow the cell label */
 static scvalue_t scvalue_getcell(eval_ctx_t *cp, int row, int col) {
     struct ent *p = getcell(cp->sp, row, col);
     if (p) {
@@ -507,7 +543,7 @@ static scvalue_t scvalue_getcell(eval_ctx_t *cp, int row, int col) {
         if (p->type == SC_NUMBER)
             return scvalue_number(p->v);
         if (p->type == SC_STRING)
-            return scvalue_string(string_dup(p->label));
+            return scvalue_string_ref(p->label);
         if (p->type == SC_BOOLEAN)
             return scvalue_boolean(p->v);
     }
@@ -626,9 +662,179 @@ static scvalue_t eval_index(eval_ctx_t *cp, enode_t *e) {
     return res;
 }
 
+/* compare the cell at row,col with the lookup value a.  Empty cells
+   compare as `empty` unless a is empty.
+ */
+static int lookup_cmp(sheet_t *sp, scvalue_t a, int row, int col, int empty) {
+    struct ent *p = getcell(sp, row, col);
+    if (!p || p->type == SC_EMPTY)
+        return (a.type == SC_EMPTY) ? 0 : empty;
+    if (p->type != a.type)
+        return p->type - a.type;
+    if (a.type == SC_NUMBER || a.type == SC_BOOLEAN)
+        return (p->v > a.u.v) - (p->v < a.u.v);
+    if (a.type == SC_STRING)
+        return strcmp(s2str(p->label), s2str(a.u.str));
+    return p->cellerror - a.u.error;
+}
+
+static unsigned int lookup_hash(int type, double v, const char *s) {
+    unsigned int h = 2166136261U ^ type;
+    if (s) {
+        while (*s)
+            h = (h ^ (unsigned char)*s++) * 16777619U;
+    } else {
+        unsigned long long bits;
+        if (v == 0)
+            v = 0;  /* -0 == 0 */
+        memcpy(&bits, &v, sizeof bits);
+        bits ^= bits >> 29;
+        h = (h ^ (unsigned int)bits ^ (unsigned int)(bits >> 32)) * 16777619U;
+    }
+    return h ^ (h >> 15);
+}
+
+static unsigned int lookup_hash_cell(struct ent *p) {
+    return lookup_hash(p->type, p->type == SC_ERROR ? p->cellerror : p->v,
+                       p->type == SC_STRING ? s2str(p->label) : NULL);
+}
+
+static void lookup_index_clear(lookup_index_t *ip) {
+    scxfree(ip->slots);
+    ip->slots = NULL;
+    ip->batch = 0;
+    ip->mask = -1;
+}
+
+/* index the non empty cells of the range: each slot holds the offset
+   + 1 of the last cell with a given value, as found by a linear scan.
+ */
+static int lookup_index_build(sheet_t *sp, lookup_index_t *ip) {
+    int i, n, size, row2 = ip->row2 < sp->maxrow ? ip->row2 : sp->maxrow;
+
+    lookup_index_clear(ip);
+    n = row2 - ip->row1 + 1;
+    for (size = 16; size < n * 2; size *= 2)
+        continue;
+    ip->slots = scxmalloc(size * sizeof(*ip->slots));
+    if (!ip->slots)
+        return FALSE;
+    memset(ip->slots, 0, size * sizeof(*ip->slots));
+    ip->mask = size - 1;
+    for (i = 0; i < n; i++) {
+        struct ent *p = getcell(sp, ip->row1 + i, ip->col);
+        unsigned int h;
+
+        if (!p || p->type == SC_EMPTY)
+            continue;
+        for (h = lookup_hash_cell(p);; h++) {
+            int *slot = &ip->slots[h & ip->mask];
+            struct ent *q;
+            if (!*slot)
+                break;
+            q = getcell(sp, ip->row1 + *slot - 1, ip->col);
+            if (q->type == p->type
+            &&  (p->type == SC_STRING ? !strcmp(s2c(p->label), s2c(q->label)) :
+                 p->type == SC_ERROR ? p->cellerror == q->cellerror : p->v == q->v))
+                break;
+        }
+        ip->slots[h & ip->mask] = i + 1;
+    }
+    return TRUE;
+}
+
+/* return the offset of the last cell of the range equal to a, or -1 */
+static int lookup_index_find(sheet_t *sp, lookup_index_t *ip, scvalue_t a) {
+    unsigned int h;
+
+    h = lookup_hash(a.type, a.type == SC_ERROR ? a.u.error : a.u.v,
+                    a.type == SC_STRING ? s2str(a.u.str) : NULL);
+    for (;; h++) {
+        int i = ip->slots[h & ip->mask];
+        if (!i)
+            return -1;
+        if (!lookup_cmp(sp, a, ip->row1 + i - 1, ip->col, 1))
+            return i - 1;
+    }
+}
+
+#define LOOKUP_INDEX_MIN   32   /* shorter ranges are scanned */
+#define LOOKUP_CACHE_SIZE  16   /* number of indexes kept */
+
+/* get the hash index of a column range, (re)building it if needed.
+   An index is valid as long as the version of the column mirror has
+   not changed.  The recalc threads only use the indexes marked valid
+   for the batch by recalc_batch(): they do not check the versions
+   other threads update.
+ */
+static lookup_index_t *lookup_index_get(eval_ctx_t *cp, int col, int row1, int row2) {
+    sheet_t *sp = cp->sp;
+    lookup_index_t *ip, **ipp, **lastp = NULL;
+    colmirror_t *mp;
+    int n = 0;
+
+    if (row1 < 0 || col < 0 || row2 - row1 + 1 < LOOKUP_INDEX_MIN)
+        return NULL;
+    mp = sp->colmirror ? sp->colmirror[col] : NULL;
+    for (ipp = &sp->lookup_cache; (ip = *ipp) != NULL; ipp = &ip->next, n++) {
+        if (ip->col == col && ip->row1 == row1 && ip->row2 == row2)
+            break;
+        lastp = ipp;
+    }
+    if (cp->threaded)
+        return (ip && ip->batch) ? ip : NULL;
+    if (ip && ip->slots && mp && ip->version == mp->version && ipp == &sp->lookup_cache)
+        return ip;
+    if (ip) {
+        /* move to the front */
+        *ipp = ip->next;
+    } else {
+        if (n >= LOOKUP_CACHE_SIZE) {
+            /* recycle the least recently used index */
+            ip = *lastp;
+            *lastp = NULL;
+        } else {
+            if (!(ip = scxmalloc(sizeof(*ip))))
+                return NULL;
+            ip->slots = NULL;
+        }
+        ip->col = col;
+        ip->row1 = row1;
+        ip->row2 = row2;
+        lookup_index_clear(ip);
+    }
+    ip->next = sp->lookup_cache;
+    sp->lookup_cache = ip;
+    /* cell changes are tracked by the column mirror */
+    if (!ip->slots || !mp || ip->version != mp->version) {
+        if (!(mp = colmirror_get(sp, col)) || !lookup_index_build(sp, ip)) {
+            lookup_index_clear(ip);
+            return NULL;
+        }
+        ip->version = mp->version;
+    }
+    return ip;
+}
+
+/* build the hash index of a lookup range for the recalc threads */
+static void lookup_prepare(eval_ctx_t *cp, rangeref_t rr) {
+    lookup_index_get(cp, rr.left.col, rr.left.row, rr.right.row);
+}
+
+void lookup_cache_free(sheet_t *sp) {
+    lookup_index_t *ip;
+
+    while ((ip = sp->lookup_cache) != NULL) {
+        sp->lookup_cache = ip->next;
+        scxfree(ip->slots);
+        scxfree(ip);
+    }
+}
+
 static scvalue_t eval_lookup(eval_ctx_t *cp, enode_t *e) {
     scvalue_t a = eval_node_value(cp, e->e.args[0]);
     scvalue_t rr, dest;
+    lookup_index_t *ip;
     int r, c, incc = 0, incr = 0, dr = 0, dc = 0, ncols, nrows;
     int i, count, found = -1, sorted = 1, offset = 0, err = 0;
 
@@ -658,21 +864,30 @@ static scvalue_t eval_lookup(eval_ctx_t *cp, enode_t *e) {
             }
         } else
         if (e->op == OP_LOOKUP) {
+            /* the result comes from the last column or row of the range */
             if (nrows >= ncols) {
-                incr = 1;
+                dr = incr = 1;
                 offset = ncols - 1;
             } else {
-                incc = 1;
+                dc = incc = 1;
                 offset = nrows - 1;
             }
             if (e->nargs > 2) {
+                /* or from the result vector, in either orientation */
                 dest = eval_range(cp, e->e.args[2]);
                 if (dest.type != SC_RANGE) {
                     err = dest.u.error;
                     break;
                 }
-                dr = (dest.u.rr.left.row == dest.u.rr.right.row);
-                dc = (dest.u.rr.left.col == dest.u.rr.right.col);
+                offset = 0;
+                if (dest.u.rr.left.col == dest.u.rr.right.col) {
+                    dr = 1;
+                    dc = 0;
+                } else
+                if (dest.u.rr.left.row == dest.u.rr.right.row) {
+                    dr = 0;
+                    dc = 1;
+                }
             }
         } else {
             /* op is OP_HLOOKUP or OP_VLOOKUP */
@@ -695,34 +910,32 @@ static scvalue_t eval_lookup(eval_ctx_t *cp, enode_t *e) {
             }
         }
 
-        // XXX: should implement binary search if sorted
         count = ncols * incc + nrows * incr;
-        for (i = 0; i < count; i++) {
-            struct ent *p;
-            int cmp;
-
-            r = rr.u.rr.left.row + i * incr;
-            c = rr.u.rr.left.col + i * incc;
-            p = getcell(cp->sp, r, c);
-            if (!p || p->type == SC_EMPTY) {
-                cmp = (a.type == SC_EMPTY) ? 0 : 1;
-            } else
-            if (p->type == a.type) {
-                if (a.type == SC_NUMBER || a.type == SC_BOOLEAN) {
-                    cmp = (p->v > a.u.v) - (p->v < a.u.v);
-                } else
-                if (a.type == SC_STRING) {
-                    cmp = strcmp(s2str(p->label), s2str(a.u.str));
-                } else {
-                    cmp = p->cellerror - a.u.error;
-                }
-            } else {
-                cmp = p->type - a.type;
+        if (sorted) {
+            /* binary search for the last cell not after the value in
+               sort order.  Empty cells come last.
+             */
+            int lo = 0, hi = count;
+            while (lo < hi) {
+                i = lo + (hi - lo) / 2;
+                r = rr.u.rr.left.row + i * incr;
+                c = rr.u.rr.left.col + i * incc;
+                if (lookup_cmp(cp->sp, a, r, c, sorted) * sorted > 0)
+                    hi = i;
+                else
+                    lo = i + 1;
             }
-            if (sorted > 0 && cmp > 0) break;
-            if (sorted < 0 && cmp < 0) break;
-            if (sorted || cmp == 0) {
-                found = i;
+            found = lo - 1;
+        } else
+        if (incr && a.type != SC_EMPTY
+        &&  (ip = lookup_index_get(cp, rr.u.rr.left.col, rr.u.rr.left.row, rr.u.rr.right.row))) {
+            found = lookup_index_find(cp->sp, ip, a);
+        } else {
+            for (i = 0; i < count; i++) {
+                r = rr.u.rr.left.row + i * incr;
+                c = rr.u.rr.left.col + i * incc;
+                if (!lookup_cmp(cp->sp, a, r, c, 1))
+                    found = i;
             }
         }
         if (found >= 0) {
@@ -730,6 +943,9 @@ static scvalue_t eval_lookup(eval_ctx_t *cp, enode_t *e) {
             if (e->op == OP_MATCH) return scvalue_number(found + 1);
             r = dest.u.rr.left.row + (dr ? found : offset);
             c = dest.u.rr.left.col + (dc ? found : offset);
+            /* stay within the result range */
+            if (r > dest.u.rr.right.row || c > dest.u.rr.right.col)
+                return scvalue_error(ERROR_REF);
             return scvalue_range(rangeref(r, c, r, c));
         }
         err = ERROR_NA;
@@ -741,15 +957,15 @@ static scvalue_t eval_lookup(eval_ctx_t *cp, enode_t *e) {
 
 /*---------------- aggregate functions ----------------*/
 
-static int eval_test(eval_ctx_t *cp, enode_t *e, int *errp) {
-    scvalue_t a = eval_node_value(cp, e);
+/* convert a value to a truth value, free it */
+static int scvalue_test(scvalue_t a, int *errp) {
     switch (a.type) {
     case SC_NUMBER:
     case SC_BOOLEAN:
         return a.u.v != 0;
     case SC_STRING: {
             int res = s2str(a.u.str)[0] != '\0';
-            string_free(a.u.str);
+            scvalue_free(a);
             return res;
         }
     case SC_ERROR:
@@ -761,6 +977,10 @@ static int eval_test(eval_ctx_t *cp, enode_t *e, int *errp) {
     }
 }
 
+static int eval_test(eval_ctx_t *cp, enode_t *e, int *errp) {
+    return scvalue_test(eval_node_value(cp, e), errp);
+}
+
 #if 0
 static int eval_test_offset(eval_ctx_t *cp, enode_t *e, int roffset, int coffset, int *errp) {
     int save_rowoffset = cp->rowoffset;
@@ -996,6 +1216,145 @@ static scvalue_t aggregate_varp_ret(eval_ctx_t *cp, struct aggregatedata_t *ap)
     return scvalue_number(rp);
 }
 
+/* prepare the column mirrors to scan a range. Mirrors are only built
+   for tall ranges, not too short compared to the sheet height.
+   return FALSE if the range should be scanned with getcell().
+   Recalc threads only use the mirrors already built.
+ */
+static int range_mirror(eval_ctx_t *cp, rangeref_t rr) {
+    sheet_t *sp = cp->sp;
+    int c, maxc = rr.right.col < sp->maxcol ? rr.right.col : sp->maxcol;
+    int height = rr.right.row - rr.left.row + 1;
+
+    if (rr.left.row < 0 || rr.left.col < 0 || height < COLMIRROR_MIN_ROWS)
+        return FALSE;
+    for (c = rr.left.col; c <= maxc; c++) {
+        colmirror_t *mp = sp->colmirror ? sp->colmirror[c] : NULL;
+        if (mp && mp->valid)
+            continue;
+        if (cp->threaded)
+            return FALSE;
+        /* build mirrors for tall ranges, repairs are cheap */
+        if (height * 4 < sp->maxrow + 1
+        &&  !(mp && mp->ndirty >= 0 && mp->nrows == sp->maxrow + 1))
+            return FALSE;
+        if (!colmirror_get(sp, c))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* get the type and value of a cell for range scans, from the column
+   mirror if valid. The value is the error number for SC_ERROR and 0
+   for SC_STRING.
+ */
+static inline int cell_value(sheet_t *sp, int row, int col, double *vp) {
+    colmirror_t *mp;
+    struct ent *p;
+
+    *vp = 0.0;
+    if (row < 0 || col < 0 || row > sp->maxrow || col > sp->maxcol)
+        return SC_EMPTY;
+    if (sp->colmirror && (mp = sp->colmirror[col]) && mp->valid) {
+        if (row >= mp->nrows)
+            return SC_EMPTY;
+        *vp = mp->v[row];
+        return mp->type[row];
+    }
+    if (!(p = getcell(sp, row, col)))
+        return SC_EMPTY;
+    *vp = colmirror_value(p);
+    return p->type;
+}
+
+/* aggregate the rows r1 to r2 of a mirrored column from its running
+   totals: the count, sum and sum of squares only.  The recalc threads
+   only use the entries prepared before the batch (see recalc_batch()).
+   return FALSE if the totals are not available.
+ */
+static int aggregate_prefix(eval_ctx_t *cp, colmirror_t *mp, int r1, int r2,
+                            aggrvec_t *ap, int allvalues)
+{
+    const colprefix_t *p1, *p2;
+    double s, bp, lo, sum, sum2;
+
+    if (cp->threaded) {
+        if (mp->pbatch <= r2)
+            return FALSE;
+    } else
+    if (mp->pvalid <= r2 && !colmirror_prefix(mp, r2 + 1)) {
+        return FALSE;
+    }
+    p1 = &mp->prefix[r1];
+    p2 = &mp->prefix[r2 + 1];
+    /* the totals overflowed, possibly because of values outside the
+       range: scan the range instead.
+     */
+    if (!isfinite(p1->sum) || !isfinite(p1->sum2)
+    ||  !isfinite(p2->sum) || !isfinite(p2->sum2))
+        return FALSE;
+    s = p2->sum - p1->sum;
+    bp = s - p2->sum;
+    lo = (p2->sum - (s - bp)) + (-p1->sum - bp);
+    sum = s + (lo + (p2->sumlo - p1->sumlo));
+    s = p2->sum2 - p1->sum2;
+    bp = s - p2->sum2;
+    lo = (p2->sum2 - (s - bp)) + (-p1->sum2 - bp);
+    sum2 = s + (lo + (p2->sum2lo - p1->sum2lo));
+    if (!isfinite(sum) || !isfinite(sum2))
+        return FALSE;
+    ap->count += p2->count - p1->count;
+    ap->sum += sum;
+    ap->sum2 += sum2;
+    if (allvalues) {
+        ap->count += (p2->nbool - p1->nbool) + (p2->nother - p1->nother);
+        ap->sum += p2->bsum - p1->bsum;
+        ap->sum2 += p2->bsum2 - p1->bsum2;
+    }
+    return TRUE;
+}
+
+/* aggregate a range with mirrored columns using the block kernels, or
+   the running totals for sums and counts.  Values are accumulated
+   column by column.
+ */
+static void aggregate_range(eval_ctx_t *cp, rangeref_t rr,
+                            void (*fun)(struct aggregatedata_t *ap, double v),
+                            struct aggregatedata_t *ap, int allvalues)
+{
+    sheet_t *sp = cp->sp;
+    int c, maxc = rr.right.col < sp->maxcol ? rr.right.col : sp->maxcol;
+    int totals = (fun == aggregate_sum || fun == aggregate_sum2 || fun == aggregate_count);
+    aggrvec_t a;
+
+    aggrvec_init(&a);
+    for (c = rr.left.col; c <= maxc; c++) {
+        colmirror_t *mp = sp->colmirror[c];
+        int r2 = rr.right.row < mp->nrows ? rr.right.row : mp->nrows - 1;
+        if (totals && r2 >= rr.left.row
+        &&  aggregate_prefix(cp, mp, rr.left.row, r2, &a, allvalues))
+            continue;
+        aggregate_values(&a, mp->v + rr.left.row, mp->type + rr.left.row,
+                         r2 - rr.left.row + 1, allvalues);
+    }
+    if (!a.count)
+        return;
+    if (fun == aggregate_min) {
+        if (!ap->count || ap->v > a.min) ap->v = a.min;
+    } else
+    if (fun == aggregate_max) {
+        if (!ap->count || ap->v < a.max) ap->v = a.max;
+    } else
+    if (fun == aggregate_sum) {
+        ap->v += a.sum;
+    } else
+    if (fun == aggregate_sum2) {
+        ap->v += a.sum;
+        ap->v2 += a.sum2;
+    }
+    ap->count += a.count;
+}
+
 static scvalue_t eval_aggregate(eval_ctx_t *cp, enode_t *ep,
                                 void (*fun)(struct aggregatedata_t *ap, double v),
                                 scvalue_t (*retfun)(eval_ctx_t *cp, struct aggregatedata_t *ap),
@@ -1012,16 +1371,18 @@ static scvalue_t eval_aggregate(eval_ctx_t *cp, enode_t *ep,
         switch (res.type) {
         case SC_RANGE: {
                 int r, c;
-                struct ent *p;
-                for (r = res.u.rr.left.row; r <= res.u.rr.right.row; r++) {
+                double v;
+                if (range_mirror(cp, res.u.rr) && fun != aggregate_product) {
+                    aggregate_range(cp, res.u.rr, fun, &pack, allvalues);
+                    break;
+                }
+                for (r = res.u.rr.left.row; r <= res.u.rr.right.row && r <= cp->sp->maxrow; r++) {
                     for (c = res.u.rr.left.col; c <= res.u.rr.right.col; c++) {
-                        if ((p = getcell(cp->sp, r, c))) {
-                            switch (p->type) {
-                            case SC_BOOLEAN: if (!allvalues) break; FALLTHROUGH;
-                            case SC_NUMBER:  fun(&pack, p->v); break;
-                            case SC_STRING:
-                            case SC_ERROR:   if (allvalues) fun(&pack, 0); break;
-                            }
+                        switch (cell_value(cp->sp, r, c, &v)) {
+                        case SC_BOOLEAN: if (!allvalues) break; FALLTHROUGH;
+                        case SC_NUMBER:  fun(&pack, v); break;
+                        case SC_STRING:
+                        case SC_ERROR:   if (allvalues) fun(&pack, 0); break;
                         }
                     }
                 }
@@ -1029,7 +1390,7 @@ static scvalue_t eval_aggregate(eval_ctx_t *cp, enode_t *ep,
             }
         case SC_NUMBER:     fun(&pack, res.u.v); break;
         case SC_BOOLEAN:    if (allvalues) fun(&pack, res.u.v); break;
-        case SC_STRING:     string_free(res.u.str); FALLTHROUGH;
+        case SC_STRING:     scvalue_free(res); FALLTHROUGH;
         case SC_ERROR:      if (allvalues) fun(&pack, 0); break;
         }
     }
@@ -1068,17 +1429,89 @@ enum cmp_mask {
     CMP_NE = 8,
 };
 
-typedef struct criterion {
+typedef struct criterion criterion_t;
+struct criterion {
+    /* compiled predicate for the criterion type */
+    int (*test)(const criterion_t *crtp, struct ent *p);
     scvalue_t a;    /* value used for matching */
     const char *s;  /* pointer into a.u.str for string matching */
     int mask;       /* comparison operator bits */
     int col;        /* database column */
-} criterion_t;
+};
+
+/* match string s with pattern pat: `*` matches any sequence of
+   characters, `?` any single character and `~` quotes the next one.
+ */
+static int wildcard_match(const char *pat, const char *s) {
+    const char *star = NULL, *back = NULL;
+
+    for (;;) {
+        if (*pat == '*') {
+            star = ++pat;
+            back = s;
+            continue;
+        }
+        if (*s == '\0') {
+            if (*pat == '\0')
+                return TRUE;
+        } else
+        if (*pat == '?') {
+            pat++;
+            s++;
+            continue;
+        } else {
+            const char *p = pat;
+            if (*p == '~' && p[1] != '\0')
+                p++;
+            if (*p == *s) {
+                pat = p + 1;
+                s++;
+                continue;
+            }
+        }
+        /* mismatch: let the last star match one more character */
+        if (!star || *back == '\0')
+            return FALSE;
+        pat = star;
+        s = ++back;
+    }
+}
+
+static int criterion_test_empty(const criterion_t *crtp, struct ent *p) {
+    return crtp->mask & ((!p || p->type == SC_EMPTY) ? CMP_EQ : CMP_NE);
+}
+
+static int criterion_test_number(const criterion_t *crtp, struct ent *p) {
+    if (!p || p->type != crtp->a.type)
+        return crtp->mask & CMP_NE;
+    if (p->v == crtp->a.u.v)
+        return crtp->mask & CMP_EQ;
+    return crtp->mask & (CMP_NE | (p->v < crtp->a.u.v ? CMP_LT : CMP_GT));
+}
+
+static int criterion_test_string(const criterion_t *crtp, struct ent *p) {
+    int cmp;
+    if (!p || p->type != SC_STRING)
+        return crtp->mask & CMP_NE;
+    cmp = strcmp(s2c(p->label), crtp->s);
+    return crtp->mask & ((cmp == 0 ? CMP_EQ : CMP_NE | (cmp < 0 ? CMP_LT : CMP_GT)));
+}
+
+static int criterion_test_wildcard(const criterion_t *crtp, struct ent *p) {
+    if (!p || p->type != SC_STRING)
+        return crtp->mask & CMP_NE;
+    return crtp->mask & (wildcard_match(crtp->s, s2c(p->label)) ? CMP_EQ : CMP_NE);
+}
 
-static void criterion_free(criterion_t *crtp) {
-    scvalue_free(crtp->a);
+static int criterion_test_error(const criterion_t *crtp, struct ent *p) {
+    int cmp;
+    if (!p || p->type != SC_ERROR)
+        return crtp->mask & CMP_NE;
+    cmp = p->cellerror - crtp->a.u.error;
+    return crtp->mask & ((cmp == 0 ? CMP_EQ : CMP_NE | (cmp < 0 ? CMP_LT : CMP_GT)));
 }
 
+/* compile criterion a into a predicate, taking ownership of a */
 static int criterion_setup(criterion_t *crtp, scvalue_t a) {
     int cmp_mask = CMP_EQ;
     const char *s = NULL;
@@ -1125,7 +1558,7 @@ static int criterion_setup(criterion_t *crtp, scvalue_t a) {
             double v;
             char *endp;
             v = strtod(s, &endp);
-            if (s > endp && !*s) {
+            if (endp > s && !*endp) {
                 scvalue_free(a);
                 a = scvalue_number(v);
             } else
@@ -1140,79 +1573,294 @@ static int criterion_setup(criterion_t *crtp, scvalue_t a) {
         }
         break;
     }
-    /* a.type is one of SC_EMPTY, SC_NUMBER, SC_STRING, SC_BOOLEAN */
+    /* a.type is one of SC_EMPTY, SC_NUMBER, SC_STRING, SC_BOOLEAN, SC_ERROR */
     /* cmp_mask is one of CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GE, CMP_GT */
     /* s is used for string matching */
     crtp->a = a;
     crtp->s = s;
     crtp->mask = cmp_mask;
+    switch (a.type) {
+    case SC_EMPTY:
+        crtp->test = criterion_test_empty;
+        break;
+    case SC_STRING:
+        crtp->test = criterion_test_string;
+        if ((cmp_mask == CMP_EQ || cmp_mask == CMP_NE) && s[strcspn(s, "*?~")])
+            crtp->test = criterion_test_wildcard;
+        break;
+    case SC_ERROR:
+        crtp->test = criterion_test_error;
+        break;
+    default:
+        crtp->test = criterion_test_number;
+        break;
+    }
     return 0;
 }
 
-static int criterion_test(criterion_t *crtp, struct ent *p) {
-    int cmp, mask = crtp->mask;
-    if (!p || p->type == SC_EMPTY) {
-        return mask & ((crtp->a.type == SC_EMPTY) ? CMP_EQ : CMP_NE);
-    } else
-    if (p->type == crtp->a.type) {
-        if (crtp->a.type == SC_NUMBER || crtp->a.type == SC_BOOLEAN) {
-            cmp = (p->v > crtp->a.u.v) - (p->v < crtp->a.u.v);
-        } else
-        if (crtp->a.type == SC_STRING) {
-            cmp = strcmp(s2c(p->label), crtp->s);
-        } else {
-            cmp = p->cellerror - crtp->a.u.error;
+static inline int criterion_test(const criterion_t *crtp, struct ent *p) {
+    return crtp->test(crtp, p);
+}
+
+/*---- match bitmaps for the conditional aggregates ----*/
+
+#define CRIT_CACHE_SIZE  64    /* number of bitmaps kept */
+
+static int critmap_nwords(rangeref_t rr) {
+    long n = (long)(rr.right.row - rr.left.row + 1) * (rr.right.col - rr.left.col + 1);
+    return (int)((n + 31) / 32);
+}
+
+static int critmap_key_same(scvalue_t k, scvalue_t a) {
+    if (k.type != a.type)
+        return FALSE;
+    switch (a.type) {
+    case SC_NUMBER:
+    case SC_BOOLEAN:    return k.u.v == a.u.v;
+    case SC_STRING:     return !strcmp(s2c(k.u.str), s2c(a.u.str));
+    case SC_ERROR:      return k.u.error == a.u.error;
+    default:            return TRUE;
+    }
+}
+
+/* a bitmap is valid as long as no cell changes in its columns */
+static int critmap_valid(sheet_t *sp, critmap_t *mp) {
+    int c;
+    if (!sp->colmirror)
+        return FALSE;
+    for (c = mp->rr.left.col; c <= mp->rr.right.col; c++) {
+        colmirror_t *cmp = sp->colmirror[c];
+        if (!cmp || cmp->version != mp->versions[c - mp->rr.left.col])
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void critmap_free(critmap_t *mp) {
+    scvalue_free(mp->key);
+    scxfree(mp->versions);
+    scxfree(mp->bits);
+    scxfree(mp);
+}
+
+void crit_cache_free(sheet_t *sp) {
+    critmap_t *mp;
+
+    while ((mp = sp->crit_cache) != NULL) {
+        sp->crit_cache = mp->next;
+        critmap_free(mp);
+    }
+}
+
+static void critmap_build(sheet_t *sp, rangeref_t rr, const criterion_t *crtp, unsigned int *bits) {
+    colmirror_t *mp;
+    int r, c, k = 0;
+
+    memset(bits, 0, critmap_nwords(rr) * sizeof(*bits));
+    if (crtp->test == criterion_test_number && rr.left.col == rr.right.col
+    &&  sp->colmirror && (mp = sp->colmirror[rr.left.col]) && mp->valid) {
+        /* numeric criterion on a column: scan the column mirror */
+        int type = crtp->a.type, mask = crtp->mask;
+        double a = crtp->a.u.v;
+        for (r = rr.left.row; r <= rr.right.row; r++, k++) {
+            int m = CMP_NE;
+            if (r < mp->nrows && mp->type[r] == type) {
+                double v = mp->v[r];
+                m = (v == a) ? CMP_EQ : CMP_NE | (v < a ? CMP_LT : CMP_GT);
+            }
+            if (mask & m)
+                bits[k >> 5] |= 1U << (k & 31);
+        }
+        return;
+    }
+    for (r = rr.left.row; r <= rr.right.row; r++) {
+        for (c = rr.left.col; c <= rr.right.col; c++, k++) {
+            if (criterion_test(crtp, getcell(sp, r, c)))
+                bits[k >> 5] |= 1U << (k & 31);
+        }
+    }
+}
+
+/* return the bitmap of the cells of range rr matching criterion a.
+   Bitmaps are shared by the formulas using the same criterion on the
+   same range and kept until a cell of the range columns changes.  The
+   recalc threads only use the bitmaps marked valid for the batch by
+   recalc_batch().  If the bitmap cannot be
+   cached, it is returned in *tmpp and must be freed by the caller.
+ */
+static const unsigned int *critmap_get(eval_ctx_t *cp, rangeref_t rr, scvalue_t a,
+                                       SCXMEM unsigned int **tmpp)
+{
+    sheet_t *sp = cp->sp;
+    critmap_t *mp, **mpp, **lastp = NULL;
+    criterion_t crit;
+    int c, n = 0, nwords = critmap_nwords(rr);
+
+    *tmpp = NULL;
+    for (mpp = &sp->crit_cache; (mp = *mpp) != NULL; mpp = &mp->next, n++) {
+        if (range_same(mp->rr, rr) && critmap_key_same(mp->key, a)
+        &&  (cp->threaded ? mp->batch : critmap_valid(sp, mp)))
+            break;
+        lastp = mpp;
+    }
+    if (mp) {
+        if (!cp->threaded) {
+            /* move to the front */
+            *mpp = mp->next;
+            mp->next = sp->crit_cache;
+            sp->crit_cache = mp;
+        }
+        return mp->bits;
+    }
+    /* the criterion does not own the value */
+    criterion_setup(&crit, a.type == SC_STRING ? scvalue_string_ref(a.u.str) : a);
+    if (!cp->threaded) {
+        /* build the column mirrors so cell changes are tracked */
+        for (c = rr.left.col; c <= rr.right.col; c++) {
+            if (!colmirror_get(sp, c))
+                break;
+        }
+        if (c > rr.right.col) {
+            if (n >= CRIT_CACHE_SIZE) {
+                /* drop the least recently used bitmap */
+                mp = *lastp;
+                *lastp = NULL;
+                critmap_free(mp);
+            }
+            if ((mp = scxmalloc(sizeof(*mp)))) {
+                mp->rr = rr;
+                mp->batch = 0;
+                mp->key = scvalue_own(a.type == SC_STRING ? scvalue_string_ref(a.u.str) : a);
+                mp->versions = scxmalloc((rr.right.col - rr.left.col + 1) * sizeof(*mp->versions));
+                mp->bits = scxmalloc(nwords * sizeof(*mp->bits));
+                if (!mp->versions || !mp->bits) {
+                    critmap_free(mp);
+                    return NULL;
+                }
+                for (c = rr.left.col; c <= rr.right.col; c++)
+                    mp->versions[c - rr.left.col] = sp->colmirror[c]->version;
+                critmap_build(sp, rr, &crit, mp->bits);
+                mp->next = sp->crit_cache;
+                sp->crit_cache = mp;
+                return mp->bits;
+            }
         }
-        return mask & ((cmp == 0 ? CMP_EQ : CMP_NE | (cmp < 0 ? CMP_LT : CMP_GT)));
-    } else {
-        return mask & CMP_NE;
     }
+    if ((*tmpp = scxmalloc(nwords * sizeof(**tmpp))))
+        critmap_build(sp, rr, &crit, *tmpp);
+    return *tmpp;
 }
 
+/* conditional aggregates: the criteria are tested on the criteria
+   ranges into match bitmaps and the values of the matching cells are
+   aggregated.  For the IFS variants, the value range comes first
+   (except for COUNTIFS), followed by pairs of criteria range and
+   criterion, all ranges having the same size.
+ */
 static scvalue_t eval_aggregateif(eval_ctx_t *cp, enode_t *e,
                                   void (*fun)(struct aggregatedata_t *ap, double v),
                                   scvalue_t (*retfun)(eval_ctx_t *cp, struct aggregatedata_t *ap),
                                   int ifs)
 {
     struct aggregatedata_t pack = { 0, 0, 0, 0, 0 };
-    scvalue_t res = eval_range(cp, e->e.args[0]);
-    criterion_t crit;
-    int r, c, dr = 0, dc = 0;
-
-    if (res.type != SC_RANGE)
-        return scvalue_error(res.u.error);
+    const unsigned int *set = NULL, *bits;
+    SCXMEM unsigned int *own = NULL, *tmp = NULL;
+    rangeref_t rr0 = rangeref_empty();
+    scvalue_t res, vr;
+    int i, k, b, nwords = 0, ncols = 0, first = 0, dr = 0, dc = 0, err = 0;
 
     if (fun == aggregate_product)
         pack.v = 1.0;
 
-    if (e->nargs & 1) {
-        scvalue_t vr = eval_range(cp, e->e.args[e->nargs - 1]);
-        if (vr.type != SC_RANGE)
-            return scvalue_error(vr.u.error);
-        dr = vr.u.rr.left.row - res.u.rr.left.row;
-        dc = vr.u.rr.left.col - res.u.rr.left.col;
-    }
-    // XXX: should implement IFS
-    criterion_setup(&crit, eval_node_value(cp, e->e.args[1]));
-    for (r = res.u.rr.left.row; r <= res.u.rr.right.row; r++) {
-        for (c = res.u.rr.left.col; c <= res.u.rr.right.col; c++) {
-            struct ent *p = getcell(cp->sp, r, c);
-            if (criterion_test(&crit, p)) {
-                if (!fun) {
-                    pack.count++;
-                    continue;
-                }
-                if (dr | dc) {
-                    /* Get values from optional value range */
-                    p = getcell(cp->sp, r + dr, c + dc);
-                }
-                if (p && p->type == SC_NUMBER) {
-                    fun(&pack, p->v);
+    vr.type = SC_EMPTY;
+    if (ifs) {
+        if (fun) {
+            /* value range comes first */
+            vr = eval_range(cp, e->e.args[0]);
+            first = 1;
+        }
+        if ((e->nargs - first) & 1)
+            return scvalue_error(ERROR_VALUE);
+    } else
+    if (e->nargs > 2) {
+        vr = eval_range(cp, e->e.args[2]);
+    }
+    if (vr.type == SC_ERROR)
+        return vr;
+
+    for (i = first; i + 1 < e->nargs && (!i || ifs); i += 2) {
+        scvalue_t a;
+
+        res = eval_range(cp, e->e.args[i]);
+        if (res.type != SC_RANGE) {
+            err = res.u.error;
+            break;
+        }
+        if (i == first) {
+            rr0 = res.u.rr;
+            ncols = rr0.right.col - rr0.left.col + 1;
+            nwords = critmap_nwords(rr0);
+        } else
+        if (res.u.rr.right.row - res.u.rr.left.row != rr0.right.row - rr0.left.row
+        ||  res.u.rr.right.col - res.u.rr.left.col != rr0.right.col - rr0.left.col) {
+            err = ERROR_VALUE;
+            break;
+        }
+        a = eval_node_value(cp, e->e.args[i + 1]);
+        bits = critmap_get(cp, res.u.rr, a, &tmp);
+        scvalue_free(a);
+        if (!bits) {
+            err = ERROR_MEM;
+            break;
+        }
+        if (!set) {
+            set = bits;
+            own = tmp;
+        } else {
+            /* intersect with the previous criteria */
+            if (!own) {
+                if (!(own = scxmalloc(nwords * sizeof(*own)))) {
+                    scxfree(tmp);
+                    err = ERROR_MEM;
+                    break;
                 }
+                memcpy(own, set, nwords * sizeof(*own));
+                set = own;
+            }
+            for (k = 0; k < nwords; k++)
+                own[k] &= bits[k];
+            scxfree(tmp);
+        }
+        tmp = NULL;
+    }
+    if (!err && vr.type == SC_RANGE) {
+        /* Get values from optional value range */
+        dr = vr.u.rr.left.row - rr0.left.row;
+        dc = vr.u.rr.left.col - rr0.left.col;
+    }
+    for (k = 0; !err && k < nwords; k++) {
+        unsigned int w = set[k];
+        for (b = 0; w; b++, w >>= 1) {
+            int r, c;
+            struct ent *p;
+
+            if (!(w & 1))
+                continue;
+            if (!fun) {
+                pack.count++;
+                continue;
+            }
+            r = rr0.left.row + (k * 32 + b) / ncols;
+            c = rr0.left.col + (k * 32 + b) % ncols;
+            p = getcell(cp->sp, r + dr, c + dc);
+            if (p && p->type == SC_NUMBER) {
+                fun(&pack, p->v);
             }
         }
     }
-    criterion_free(&crit);
+    scxfree(own);
+    if (err)
+        return scvalue_error(err);
     return retfun(cp, &pack);
 }
 
@@ -1233,7 +1881,7 @@ static scvalue_t eval_countblank(eval_ctx_t *cp, enode_t *ep) {
             }
             break;
         case SC_EMPTY:      count++; break;
-        case SC_STRING:     string_free(res.u.str); break;
+        case SC_STRING:     scvalue_free(res); break;
         }
     }
     return scvalue_number(count);
@@ -1321,6 +1969,7 @@ static scvalue_t eval_sumproduct(eval_ctx_t *cp, enode_t *e) {
         nr = res.u.rr.right.row - res.u.rr.left.row + 1;
         nc = res.u.rr.right.col - res.u.rr.left.col + 1;
         range[i] = res.u.rr;
+        range_mirror(cp, res.u.rr);
         if (i == 0) {
             nrows = nr;
             ncols = nc;
@@ -1332,19 +1981,20 @@ static scvalue_t eval_sumproduct(eval_ctx_t *cp, enode_t *e) {
     }
     for (dr = 0; dr < nrows; dr++) {
         for (dc = 0; dc < ncols; dc++) {
-            double prod = 1.0;
+            double prod = 1.0, v;
             for (i = 0; i < n; i++) {
-                struct ent *p = getcell(cp->sp, range[i].left.row + dr, range[i].left.col + dc);
-                if (!p || p->type == SC_EMPTY || p->type == SC_STRING)
-                    goto done1;
-                if (p->type == SC_ERROR) {
-                    err = p->cellerror;
+                int type = cell_value(cp->sp, range[i].left.row + dr, range[i].left.col + dc, &v);
+                if (type == SC_EMPTY || type == SC_STRING) {
+                    /* non numeric entries are treated as 0 */
+                    prod = 0.0;
+                    break;
+                }
+                if (type == SC_ERROR) {
+                    err = (int)v;
                     goto done2;
                 }
-                if (p->type == SC_NUMBER || p->type == SC_BOOLEAN)
-                    prod *= p->v;
+                prod *= v;
             }
-        done1:
             sum += prod;
         }
     }
@@ -1378,25 +2028,18 @@ static scvalue_t eval_sumxy(eval_ctx_t *cp, enode_t *e) {
         err = ERROR_VALUE;
         goto done;
     }
+    range_mirror(cp, a.u.rr);
+    range_mirror(cp, b.u.rr);
     for (dr = 0; dr < nrows; dr++) {
         for (dc = 0; dc < ncols; dc++) {
-            double v1 = 0.0, v2 = 0.0;
-            struct ent *p;
-            if ((p = getcell(cp->sp, a.u.rr.left.row + dr, a.u.rr.left.col + dc))) {
-                if (p->type == SC_ERROR) {
-                    err = p->cellerror;
-                    goto done;
-                }
-                if (p->type == SC_NUMBER || p->type == SC_BOOLEAN)
-                    v1 = p->v;
+            double v1, v2;
+            if (cell_value(cp->sp, a.u.rr.left.row + dr, a.u.rr.left.col + dc, &v1) == SC_ERROR) {
+                err = (int)v1;
+                goto done;
             }
-            if ((p = getcell(cp->sp, b.u.rr.left.row + dr, b.u.rr.left.col + dc))) {
-                if (p->type == SC_ERROR) {
-                    err = p->cellerror;
-                    goto done;
-                }
-                if (p->type == SC_NUMBER || p->type == SC_BOOLEAN)
-                    v2 = p->v;
+            if (cell_value(cp->sp, b.u.rr.left.row + dr, b.u.rr.left.col + dc, &v2) == SC_ERROR) {
+                err = (int)v2;
+                goto done;
             }
             switch (e->op) {
             case OP_SUMX2MY2: sum += v1 * v1 - v2 * v2; break;
@@ -1426,84 +2069,116 @@ static int db_lookup_field(eval_ctx_t *cp, rangeref_t rr, const char *name) {
     return -1;
 }
 
-static scvalue_t eval_db(eval_ctx_t *cp, enode_t *e,
-                         void (*fun)(struct aggregatedata_t *ap, double v),
-                         scvalue_t (*retfun)(eval_ctx_t *cp, struct aggregatedata_t *ap),
-                         int allvalues)
-{
-    struct aggregatedata_t pack = { 0, 0, 0, 0, 0 };
-    criterion_t *critp = NULL;
-    scvalue_t db, field, crit;
-    int err = 0, r, col = -1, i, ncrit = 0;
-    struct ent *p;
-
-    if (fun == aggregate_product)
-        pack.v = 1.0;
+/* get the database column of a field given by name or position */
+static int db_field(eval_ctx_t *cp, rangeref_t db, scvalue_t field) {
+    if (field.type == SC_STRING)
+        return db_lookup_field(cp, db, s2c(field.u.str));
+    if (field.type == SC_NUMBER && field.u.v >= 1 && field.u.v < db.right.col - db.left.col + 2)
+        return db.left.col + (int)field.u.v - 1;
+    return -1;
+}
 
-    for (;;) {
-        db = eval_range(cp, e->e.args[0]);
-        if (db.type != SC_RANGE) {
-            err = db.u.error;
-            break;
-        }
-        crit = eval_range(cp, e->e.args[2]);
-        if (crit.type != SC_RANGE) {
-            err = crit.u.error;
-            break;
-        }
-        field = eval_node_value(cp, e->e.args[1]);
-        if (field.type == SC_ERROR) {
-            err = field.u.error;
-            break;
-        }
-        /* look up field (except count) */
-        if (field.type == SC_STRING) {
-            col = db_lookup_field(cp, db.u.rr, s2c(field.u.str));
-        } else
-        if (field.type == SC_NUMBER) {
-            col = db.u.rr.left.col + (int)floor(field.u.v) - 1;
-        }
-        scvalue_free(field);
-        if (col < db.u.rr.left.col || col > db.u.rr.right.col) {
-            if (fun == aggregate_count && field.type == SC_EMPTY) {
-                fun = NULL;
-            } else {
-                err = ERROR_VALUE;
+/* select the records of database db matching the criteria range crit
+   and return them as a bitmap, one bit per record.  The first row of
+   crit holds field names, each further row is an alternative: all its
+   non empty criteria must match.  The criteria are tested on the whole
+   field columns into match bitmaps, shared by the database functions
+   using the same table.
+ */
+static SCXMEM unsigned int *db_select(eval_ctx_t *cp, rangeref_t db, rangeref_t crit, int *errp) {
+    SCXMEM unsigned int *sel, *and, *tmp;
+    const unsigned int *bits;
+    int r, c, k, fcol, nrec = db.right.row - db.left.row;
+    int nwords = nrec > 0 ? (nrec + 31) / 32 : 1;
+
+    sel = scxmalloc(nwords * sizeof(*sel));
+    and = scxmalloc(nwords * sizeof(*and));
+    if (!sel || !and) {
+        scxfree(sel);
+        scxfree(and);
+        *errp = ERROR_MEM;
+        return NULL;
+    }
+    memset(sel, 0, nwords * sizeof(*sel));
+    for (r = crit.left.row + 1; r <= crit.right.row && nrec > 0; r++) {
+        /* records matching all the criteria of the row */
+        memset(and, 0xff, nwords * sizeof(*and));
+        if (nrec & 31)
+            and[nwords - 1] = (1U << (nrec & 31)) - 1;
+        for (c = crit.left.col; c <= crit.right.col; c++) {
+            scvalue_t a = scvalue_getcell(cp, r, c);
+            if (a.type == SC_EMPTY)
+                continue;
+            fcol = db_field(cp, db, scvalue_getcell(cp, crit.left.row, c));
+            if (fcol < 0) {
+                *errp = ERROR_VALUE;
+                break;
+            }
+            bits = critmap_get(cp, rangeref(db.left.row + 1, fcol, db.right.row, fcol), a, &tmp);
+            if (!bits) {
+                *errp = ERROR_MEM;
                 break;
             }
+            for (k = 0; k < nwords; k++)
+                and[k] &= bits[k];
+            scxfree(tmp);
         }
-        /* compile criteria */
-        ncrit = crit.u.rr.right.col - crit.u.rr.left.col + 1;
-        critp = scxmalloc(ncrit * sizeof(*critp));
-        if (!critp) {
-            err = ERROR_MEM;
+        if (c <= crit.right.col) {
+            scxfree(sel);
+            sel = NULL;
             break;
         }
-        for (i = 0; i < ncrit; i++) {
-            int fcol = -1;
-            if ((p = getcell(cp->sp, crit.u.rr.left.row, crit.u.rr.left.col + i))) {
-                if (p->type == SC_STRING) {
-                    fcol = db_lookup_field(cp, db.u.rr, s2c(p->label));
-                } else
-                if (p->type == SC_NUMBER) {
-                    fcol = db.u.rr.left.col + (int)floor(field.u.v) - 1;
-                }
-            }
-            if (fcol < db.u.rr.left.col || fcol > db.u.rr.right.col)
-                err = ERROR_VALUE;
-            criterion_setup(&critp[i], scvalue_getcell(cp, crit.u.rr.left.row + 1, crit.u.rr.left.col + i));
-            critp[i].col = fcol;
+        for (k = 0; k < nwords; k++)
+            sel[k] |= and[k];
+    }
+    scxfree(and);
+    return sel;
+}
+
+static scvalue_t eval_db(eval_ctx_t *cp, enode_t *e,
+                         void (*fun)(struct aggregatedata_t *ap, double v),
+                         scvalue_t (*retfun)(eval_ctx_t *cp, struct aggregatedata_t *ap),
+                         int allvalues)
+{
+    struct aggregatedata_t pack = { 0, 0, 0, 0, 0 };
+    SCXMEM unsigned int *sel;
+    scvalue_t db, field, crit;
+    int err = 0, k, b, col, nrec;
+
+    if (fun == aggregate_product)
+        pack.v = 1.0;
+
+    db = eval_range(cp, e->e.args[0]);
+    if (db.type != SC_RANGE)
+        return scvalue_error(db.u.error);
+    crit = eval_range(cp, e->e.args[2]);
+    if (crit.type != SC_RANGE)
+        return scvalue_error(crit.u.error);
+    field = eval_node_value(cp, e->e.args[1]);
+    if (field.type == SC_ERROR)
+        return field;
+    /* look up field (except count) */
+    col = db_field(cp, db.u.rr, field);
+    if (col < 0) {
+        if (fun == aggregate_count && field.type == SC_EMPTY) {
+            fun = NULL;
+        } else {
+            err = ERROR_VALUE;
         }
-        if (err) break;
-        /* enumerate records */
-        for (r = db.u.rr.left.row + 1; r <= db.u.rr.left.row; r++) {
-            /* apply criteria */
-            for (i = 0; i < ncrit; i++) {
-                p = getcell(cp->sp, r, critp[i].col);
-                if (!criterion_test(&critp[i], p))
-                    break;
-            }
-            if (i < ncrit)
+    }
+    scvalue_free(field);
+    if (err || !(sel = db_select(cp, db.u.rr, crit.u.rr, &err)))
+        return scvalue_error(err);
+
+    /* enumerate the selected records */
+    nrec = db.u.rr.right.row - db.u.rr.left.row;
+    for (k = 0; k * 32 < nrec; k++) {
+        unsigned int w = sel[k];
+        for (b = 0; w; b++, w >>= 1) {
+            int r = db.u.rr.left.row + 1 + k * 32 + b;
+            struct ent *p;
+
+            if (!(w & 1))
                 continue;
             if (!fun) {
                 pack.row = r;
@@ -1522,15 +2197,8 @@ static scvalue_t eval_db(eval_ctx_t *cp, enode_t *e,
             }
         }
     }
-    if (critp) {
-        for (i = 0; i < ncrit; i++)
-            criterion_free(&critp[i]);
-        scxfree(critp);
-    }
-    if (err)
-        return scvalue_error(err);
-    else
-        return retfun(cp, &pack);
+    scxfree(sel);
+    return retfun(cp, &pack);
 }
 
 static scvalue_t eval_daverage(eval_ctx_t *cp, enode_t *ep) {
@@ -1577,6 +2245,76 @@ static scvalue_t eval_dvarp(eval_ctx_t *cp, enode_t *ep) {
     return eval_db(cp, ep, aggregate_sum2, aggregate_varp_ret, FALSE);
 }
 
+/* build the match bitmaps of the conditional aggregates and database
+   functions of formula e for the recalc threads, for criteria given as
+   constants or cells.
+ */
+static void criteria_prepare(eval_ctx_t *cp, enode_t *e) {
+    SCXMEM unsigned int *tmp;
+    int i, ifs;
+
+    if (!e || e->type != OP_TYPE_FUNC)
+        return;
+    for (i = 0; i < e->nargs; i++)
+        criteria_prepare(cp, e->e.args[i]);
+    switch (e->op) {
+    case OP_COUNTIF:
+    case OP_SUMIF:
+    case OP_AVERAGEIF:
+        ifs = 0;
+        i = 0;
+        break;
+    case OP_COUNTIFS:
+        ifs = 1;
+        i = 0;
+        break;
+    case OP_SUMIFS:
+    case OP_AVERAGEIFS:
+    case OP_MAXIFS:
+    case OP_MINIFS:
+        ifs = 1;
+        i = 1;
+        break;
+    case OP_DAVERAGE:
+    case OP_DCOUNT:
+    case OP_DCOUNTA:
+    case OP_DGET:
+    case OP_DMAX:
+    case OP_DMIN:
+    case OP_DPRODUCT:
+    case OP_DSTDEV:
+    case OP_DSTDEVP:
+    case OP_DSUM:
+    case OP_DVAR:
+    case OP_DVARP:
+        if (e->e.args[0]->type == OP_TYPE_RANGE && e->e.args[2]->type == OP_TYPE_RANGE) {
+            int err = 0;
+            scvalue_t db = eval_range(cp, e->e.args[0]);
+            scvalue_t crit = eval_range(cp, e->e.args[2]);
+            if (db.type == SC_RANGE && crit.type == SC_RANGE)
+                scxfree(db_select(cp, db.u.rr, crit.u.rr, &err));
+        }
+        return;
+    default:
+        return;
+    }
+    for (; i + 1 < e->nargs; i += 2) {
+        enode_t *re = e->e.args[i], *ce = e->e.args[i + 1];
+        if ((re->type == OP_TYPE_RANGE || re->type == OP_TYPE_VAR)
+        &&  (ce->type != OP_TYPE_FUNC && ce->type != OP_TYPE_RANGE)) {
+            scvalue_t rr = eval_range(cp, re);
+            scvalue_t a = eval_node_value(cp, ce);
+            if (rr.type == SC_RANGE) {
+                critmap_get(cp, rr.u.rr, a, &tmp);
+                scxfree(tmp);
+            }
+            scvalue_free(a);
+        }
+        if (!ifs)
+            break;
+    }
+}
+
 /*---------------- date and time functions ----------------*/
 
 //static short const month_days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
@@ -1670,13 +2408,12 @@ static double date_time3(double hr, double min, double sec) {
     return (double)(sec + min * 60 + hr * 3600) / 86400.0;
 }
 
-static double string_todate(SCXMEM string_t *str, int *errp) {
+static double string_todate(const string_t *str, int *errp) {
     char *endp;
     // XXX: should parse date string
     double v = strtod(s2c(str), &endp);
     if (endp == s2c(str) || *endp)
         *errp = ERROR_VALUE;
-    string_free(str);
     return v;
 }
 
@@ -1684,19 +2421,21 @@ static double eval_date_param(eval_ctx_t *cp, enode_t *e, int *errp) {
     scvalue_t res = eval_node_value(cp, e);
     if (res.type == SC_NUMBER || res.type == SC_BOOLEAN)
         return res.u.v;
-    if (res.type == SC_STRING)
-        return string_todate(res.u.str, errp);
+    if (res.type == SC_STRING) {
+        double v = string_todate(res.u.str, errp);
+        scvalue_free(res);
+        return v;
+    }
     *errp = res.u.error;
     return 0;
 }
 
-static double string_totime(SCXMEM string_t *str, int *errp) {
+static double string_totime(const string_t *str, int *errp) {
     char *endp;
     // XXX: should parse time string or date string
     double v = strtod(s2c(str), &endp);
     if (endp == s2c(str) || *endp)
         *errp = ERROR_VALUE;
-    string_free(str);
     return v;
 }
 
@@ -1704,8 +2443,11 @@ static double eval_time_param(eval_ctx_t *cp, enode_t *e, int *errp) {
     scvalue_t res = eval_node_value(cp, e);
     if (res.type == SC_NUMBER || res.type == SC_BOOLEAN)
         return res.u.v;
-    if (res.type == SC_STRING)
-        return string_totime(res.u.str, errp);
+    if (res.type == SC_STRING) {
+        double v = string_totime(res.u.str, errp);
+        scvalue_free(res);
+        return v;
+    }
     *errp = res.u.error;
     return 0;
 }
@@ -1856,7 +2598,7 @@ static scvalue_t eval_ston(eval_ctx_t *cp, enode_t *e) {
         // XXX: is an empty string an error?
         // XXX: is a blank string an error?
         v = strtod(s2str(a.u.str), &end);
-        string_free(a.u.str);
+        scvalue_free(a);
         if (*end) {
             // XXX: is this an error?
         }
@@ -1918,7 +2660,7 @@ static scvalue_t eval_nval(eval_ctx_t *cp, enode_t *e) {
     if (res.type == SC_STRING) {
         char *end;
         double v = strtod(s2str(res.u.str), &end);
-        string_free(res.u.str);
+        scvalue_free(res);
         if (!*end)
             return scvalue_number(v);
     }
@@ -1930,24 +2672,6 @@ static scvalue_t eval_nval(eval_ctx_t *cp, enode_t *e) {
 
 /*---------------- math functions ----------------*/
 
-static sigret_t eval_fpe(int i) { /* Trap for FPE errors in eval */
-    (void)i;
-#if defined(i386) && !defined(M_XENIX)
-    asm("       fnclex");
-    asm("       fwait");
-#else
-#ifdef IEEE_MATH
-    fpsetsticky((fp_except)0);    /* Clear exception */
-#endif /* IEEE_MATH */
-#ifdef PC
-    _fpreset();
-#endif
-#endif
-    /* re-establish signal handler for next time */
-    signal(SIGFPE, eval_fpe);
-    longjmp(fpe_save, 1);
-}
-
 static scvalue_t eval_fn1(eval_ctx_t *cp, enode_t *e) {
     scarg_t fun = opdefs[e->op].arg;
     int err = 0;
@@ -2122,8 +2846,9 @@ static scvalue_t eval_fmt(eval_ctx_t *cp, enode_t *e) {
 
 /*
  * Given a command name and a value, run the command with the given value and
- * read and return its first output line (only) as an allocated string, store
- * this as a third argument of @ext().
+ * return its first output line (only) as an allocated string, store this as
+ * a third argument of @ext().  The commands run asynchronously, the previous
+ * value is returned until the result arrives (see extfunc.c).
  */
 
 static scvalue_t eval_ext(eval_ctx_t *cp, enode_t *e) {
@@ -2141,7 +2866,6 @@ static scvalue_t eval_ext(eval_ctx_t *cp, enode_t *e) {
         enode_t *prev = NULL;
         SCXMEM string_t *str;
         int len, i;
-        FILE *pf;
 
         if (left && left->op == OP_DUMMY) {
             prev = left->e.args[0];
@@ -2174,26 +2898,12 @@ static scvalue_t eval_ext(eval_ctx_t *cp, enode_t *e) {
         }
         if (err) break;
 
-        //error("Running external function...");
-        //screen_refresh();
-
-        if ((pf = popen(buff, "r")) == NULL) {     /* run it */
-            error("Warning: running \"%s\" failed", buff);
-            err = ERROR_NA;
-            break;
-        }
-        if (fgets(buff, sizeof buff, pf) == NULL) {  /* one line */
-            // XXX: should use the empty string?
-            error("Warning: external function returned nothing");
-            *buff = '\0';
-        } else {
-            error(" "); /* erase notice */
-        }
-        pclose(pf);
-        str = string_new(strtrim(buff));
+        str = ext_result(cp->sp, buff, &err);
+        if (err) break;
         if (!str) {
-            err = ERROR_MEM;
-            break;
+            /* keep the previous value until the result arrives */
+            if (prev) return eval_node(cp, prev);
+            return scvalue_string(string_empty());
         }
         if (cmd == left) {
             prev = new_str(string_dup(str));
@@ -2924,7 +3634,7 @@ static scvalue_t eval_other(eval_ctx_t *cp, enode_t *e) {
     case OP_MYCOL:      val = cp->gmycol + cp->coloffset; break;
     case OP_LASTROW:    val = cp->sp->maxrow;   break;
     case OP_LASTCOL:    val = cp->sp->maxcol;   break;
-    case OP_NUMITER:    val = repct;            break;
+    case OP_NUMITER:    val = cp->numiter;      break;
     case OP_BLACK:      val = SC_COLOR_BLACK;   break;
     case OP_RED:        val = SC_COLOR_RED;     break;
     case OP_GREEN:      val = SC_COLOR_GREEN;   break;
@@ -2952,14 +3662,33 @@ struct opdef const opdefs[] = {
 #undef OP
 };
 
+/* call the evaluator of a function node and record its time for the
+   profiler.  The recalc is serial while profiling.
+ */
+static scvalue_t eval_profile(eval_ctx_t *cp, enode_t *e) {
+    static double inner;    /* time spent in the nested functions */
+    double t0 = sc_clock(), outer = inner, t;
+    scvalue_t res;
+
+    inner = 0;
+    res = opdefs[e->op].efun(cp, e);
+    t = sc_clock() - t0;
+    profile_op(e, t, t - inner);
+    inner = outer + t;
+    return res;
+}
+
 scvalue_t eval_node(eval_ctx_t *cp, enode_t *e) {
     if (e == NULL)
         return scvalue_empty();
 
     if (e->op < OP_count) {
         const struct opdef *opp = &opdefs[e->op];
-        if (opp->efun)
+        if (opp->efun) {
+            if (cp->sp->profile && e->type == OP_TYPE_FUNC)
+                return eval_profile(cp, e);
             return opp->efun(cp, e);
+        }
     }
     return eval_other(cp, e);
 }
@@ -2984,30 +3713,418 @@ scvalue_t eval_node_value(eval_ctx_t *cp, enode_t *e) {
 
 // XXX: unused?
 scvalue_t eval_at(sheet_t *sp, enode_t *e, int row, int col) {
-    eval_ctx_t cp[1] = {{ sp, row, col, 0, 0 }};
-    return eval_node_value(cp, e);
+    eval_ctx_t cp[1] = {{ sp, row, col, 0, 0, 1, 0 }};
+    return scvalue_own(eval_node_value(cp, e));
 }
 
 double neval_at(sheet_t *sp, enode_t *e, int row, int col, int *errp) {
-    eval_ctx_t cp[1] = {{ sp, row, col, 0, 0 }};
+    eval_ctx_t cp[1] = {{ sp, row, col, 0, 0, 1, 0 }};
     return eval_num(cp, e, errp);
 }
 
 SCXMEM string_t *seval_at(sheet_t *sp, enode_t *e, int row, int col, int *errp) {
-    eval_ctx_t cp[1] = {{ sp, row, col, 0, 0 }};
+    eval_ctx_t cp[1] = {{ sp, row, col, 0, 0, 1, 0 }};
     return eval_str(cp, e, errp);
 }
 
+/*---------------- bytecode evaluator ----------------*/
+
+/*
+ * Packed formulas are also compiled to a linear code for a small stack
+ * machine, stored in the packed block after the root (see enode_pack()).
+ * Arithmetic, comparisons, IF and the math functions are compiled
+ * inline, other nodes are evaluated by eval_node_value() from a VM_NODE
+ * instruction.  Constants and cell references are copied into the code
+ * so evaluation does not touch the tree: enode_compile() must be called
+ * when references are adjusted in place.  The tree remains the source
+ * for decompilation.
+ * Formulas that only combine numbers and cell references with + - * /
+ * are flagged ENODE_NUMERIC when packed by let(): their code starts with
+ * VM_NUMERIC, which runs them on doubles with vm_run_numeric() and only
+ * falls back to the general instructions for non numeric operands.
+ */
+
+/* instructions handled by vm_run_numeric(), VM_RETURN must be last */
+#define VM_NUMERIC_OPS(X) \
+    X(VM_NUMBER) X(VM_VAR) X(VM_ADD) X(VM_SUB) X(VM_MUL) X(VM_DIV) \
+    X(VM_NEG) X(VM_RETURN)
+#define VM_OTHER_OPS(X) \
+    X(VM_NUMERIC) X(VM_BOOLEAN) X(VM_ERROR) X(VM_STRING) X(VM_NODE) X(VM_FN1) \
+    X(VM_FN2) X(VM_CMP) X(VM_NOT) X(VM_TEST) X(VM_JFALSE) X(VM_JUMP)
+#define VM_OPS(X)  VM_NUMERIC_OPS(X) VM_OTHER_OPS(X)
+
+enum {
+#define X(op)  op,
+    VM_OPS(X)
+#undef X
+};
+
+#define VM_MAXSTACK  32     /* deeper formulas are not compiled */
+
+typedef struct vminstr {
+    int op;                 /* VM_xxx */
+    int arg;                /* operator, constant or jump target */
+    union {
+        double k;           /* VM_NUMBER */
+        cellref_t cr;       /* VM_VAR */
+        enode_t *e;         /* VM_STRING, VM_NODE */
+        scarg_t fun;        /* VM_FN1, VM_FN2 */
+        int label;          /* VM_JFALSE: jump target on error */
+    } u;
+} vminstr_t;
+
+typedef struct vmcomp {
+    vminstr_t *code;        /* NULL to compute the code size */
+    int pc, depth, maxdepth;
+    int other;              /* instructions not handled by vm_run_numeric() */
+} vmcomp_t;
+
+/* the code of a packed formula is stored right after the root node */
+static inline vminstr_t *enode_code(enode_t *e) {
+    return (vminstr_t *)(void *)((char *)e + enode_size(e->nargs));
+}
+
+static int vm_emit(vmcomp_t *vp, int op, int arg, int delta) {
+    if (vp->code) {
+        vp->code[vp->pc].op = op;
+        vp->code[vp->pc].arg = arg;
+    }
+    vp->depth += delta;
+    if (vp->maxdepth < vp->depth)
+        vp->maxdepth = vp->depth;
+    if (op > VM_RETURN)
+        vp->other++;
+    return vp->pc++;
+}
+
+static void vm_emit_node(vmcomp_t *vp, int op, enode_t *e) {
+    int pc = vm_emit(vp, op, 0, 1);
+    if (vp->code)
+        vp->code[pc].u.e = e;
+}
+
+/* compile e to push the value of eval_node_value(cp, e) */
+static void vm_compile(vmcomp_t *vp, enode_t *e) {
+    scvalue_t (*efun)(eval_ctx_t *cp, enode_t *e) = NULL;
+    int pc, pc2, i;
+
+    if (e && e->op < OP_count)
+        efun = opdefs[e->op].efun;
+
+    if (efun == NULL) {
+        vm_emit_node(vp, VM_NODE, e);
+    } else
+    if (efun == eval__number) {
+        pc = vm_emit(vp, VM_NUMBER, 0, 1);
+        if (vp->code)
+            vp->code[pc].u.k = e->e.k;
+    } else
+    if (efun == eval__error) {
+        vm_emit(vp, VM_ERROR, e->e.error, 1);
+    } else
+    if (efun == eval__string) {
+        vm_emit_node(vp, VM_STRING, e);
+    } else
+    if (efun == eval__var) {
+        pc = vm_emit(vp, VM_VAR, 0, 1);
+        if (vp->code)
+            vp->code[pc].u.cr = e->e.cr;
+    } else
+    if (e->nargs == 2 && (efun == eval_add || efun == eval_sub || efun == eval_mul ||
+                          efun == eval_div || efun == eval_fn2 || efun == eval_cmp)) {
+        vm_compile(vp, e->e.args[0]);
+        vm_compile(vp, e->e.args[1]);
+        pc = vm_emit(vp, efun == eval_add ? VM_ADD : efun == eval_sub ? VM_SUB :
+                     efun == eval_mul ? VM_MUL : efun == eval_div ? VM_DIV :
+                     efun == eval_fn2 ? VM_FN2 : VM_CMP, e->op, -1);
+        if (vp->code && efun == eval_fn2)
+            vp->code[pc].u.fun = opdefs[e->op].arg;
+    } else
+    if (e->nargs == 1 && (efun == eval_neg || efun == eval_fn1 || efun == eval_not)) {
+        vm_compile(vp, e->e.args[0]);
+        pc = vm_emit(vp, efun == eval_neg ? VM_NEG : efun == eval_not ? VM_NOT : VM_FN1,
+                     e->op, 0);
+        if (vp->code && efun == eval_fn1)
+            vp->code[pc].u.fun = opdefs[e->op].arg;
+    } else
+    if (e->nargs == 1 && efun == eval_uplus) {
+        vm_compile(vp, e->e.args[0]);
+    } else
+    if (e->nargs >= 1 && e->nargs <= 3 && efun == eval_if) {
+        vm_compile(vp, e->e.args[0]);
+        if (e->nargs == 1) {
+            vm_emit(vp, VM_TEST, 0, 0);
+            return;
+        }
+        pc = vm_emit(vp, VM_JFALSE, 0, -1);
+        vm_compile(vp, e->e.args[1]);
+        pc2 = vm_emit(vp, VM_JUMP, 0, -1);
+        i = vp->pc;
+        if (e->nargs > 2)
+            vm_compile(vp, e->e.args[2]);
+        else
+            vm_emit(vp, VM_BOOLEAN, FALSE, 1);
+        if (vp->code) {
+            vp->code[pc].arg = i;
+            vp->code[pc].u.label = vp->pc;
+            vp->code[pc2].arg = vp->pc;
+        }
+    } else {
+        vm_emit_node(vp, VM_NODE, e);
+    }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_COMPUTED_GOTO  1
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_LABEL(op)  &&L_##op,
+#define VM_SWITCH() \
+    static const void * const labels[] = { VM_OPS(VM_LABEL) }; \
+    VM_DISPATCH();
+#define VM_END_SWITCH()
+#define VM_CASE(op)   L_##op
+#define VM_DISPATCH() goto *labels[ip->op]
+#else
+#define VM_SWITCH()   for (;;) switch (ip->op) {
+#define VM_END_SWITCH() }
+#define VM_CASE(op)   case op
+#define VM_DISPATCH() continue
+#endif
+#define VM_NEXT()     { ip++; VM_DISPATCH(); }
+
+/* run the code of a formula that only uses arithmetic on numbers and
+   cell references (ENODE_NUMERIC), with a stack of doubles.  Return
+   FALSE if a cell is not a number or empty, or on division by zero:
+   vm_run() then continues with the general evaluator.
+ */
+static int vm_run_numeric(eval_ctx_t *cp, const vminstr_t *ip, double *vp) {
+    sheet_t *sp = cp->sp;
+    double stack[VM_MAXSTACK];
+    double *top = stack;
+    struct ent **pp, *p;
+    int row, col;
+
+    VM_SWITCH()
+    VM_CASE(VM_NUMBER):
+        *top++ = ip->u.k;
+        VM_NEXT();
+    VM_CASE(VM_VAR):
+        row = (ip->u.cr.vf & FIX_ROW) ? ip->u.cr.row : ip->u.cr.row + cp->rowoffset;
+        col = (ip->u.cr.vf & FIX_COL) ? ip->u.cr.col : ip->u.cr.col + cp->coloffset;
+        if (row < 0 || col < 0)
+            return FALSE;
+        /* inline getcell() */
+        if (row > sp->maxrow || col > sp->maxcol || !(pp = tbl_slot(sp, row, col)) || !(p = *pp)) {
+            *top++ = 0.0;
+        } else
+        if (p->flags & IS_DELETED) {
+            return FALSE;
+        } else
+        if (p->type == SC_NUMBER || p->type == SC_BOOLEAN) {
+            *top++ = p->v;
+        } else
+        if (p->type == SC_EMPTY) {
+            *top++ = 0.0;
+        } else {
+            return FALSE;
+        }
+        VM_NEXT();
+    VM_CASE(VM_ADD):
+        top--;
+        top[-1] += top[0];
+        VM_NEXT();
+    VM_CASE(VM_SUB):
+        top--;
+        top[-1] -= top[0];
+        VM_NEXT();
+    VM_CASE(VM_MUL):
+        top--;
+        top[-1] *= top[0];
+        VM_NEXT();
+    VM_CASE(VM_DIV):
+        top--;
+        if (!top[0])
+            return FALSE;
+        top[-1] /= top[0];
+        VM_NEXT();
+    VM_CASE(VM_NEG):
+        top[-1] = -top[-1];
+        VM_NEXT();
+    VM_CASE(VM_RETURN):
+        *vp = top[-1];
+        return TRUE;
+#define X(op)  VM_CASE(op):
+    VM_OTHER_OPS(X)
+#undef X
+        return FALSE;
+    VM_END_SWITCH()
+}
+
+/* run the code of a formula, return the value of the expression */
+static scvalue_t vm_run(eval_ctx_t *cp, const vminstr_t *code) {
+    scvalue_t stack[VM_MAXSTACK];
+    scvalue_t *top = stack;
+    const vminstr_t *ip = code;
+    double v;
+    int err, row, col, t;
+
+    VM_SWITCH()
+/* binary operators, with a shortcut for numbers */
+#define VM_ARITH(op) \
+        if (top[-2].type == SC_NUMBER && top[-1].type == SC_NUMBER) { \
+            top[-2].u.v = top[-2].u.v op top[-1].u.v; \
+        } else { \
+            err = 0; \
+            v = scvalue_num(top[-2], &err); \
+            v = v op scvalue_num(top[-1], &err); \
+            top[-2] = err ? scvalue_error(err) : scvalue_number(v); \
+        } \
+        top--; \
+        VM_NEXT()
+
+    VM_CASE(VM_NUMERIC):
+        /* pure arithmetic formula: try with doubles first */
+        if (vm_run_numeric(cp, ip + 1, &v))
+            return scvalue_number(v);
+        VM_NEXT();
+    VM_CASE(VM_NUMBER):
+        *top++ = scvalue_number(ip->u.k);
+        VM_NEXT();
+    VM_CASE(VM_BOOLEAN):
+        *top++ = scvalue_boolean(ip->arg);
+        VM_NEXT();
+    VM_CASE(VM_ERROR):
+        *top++ = scvalue_error(ip->arg);
+        VM_NEXT();
+    VM_CASE(VM_STRING):
+        *top++ = scvalue_string_ref(ip->u.e->e.s);
+        VM_NEXT();
+    VM_CASE(VM_VAR):
+        row = (ip->u.cr.vf & FIX_ROW) ? ip->u.cr.row : ip->u.cr.row + cp->rowoffset;
+        col = (ip->u.cr.vf & FIX_COL) ? ip->u.cr.col : ip->u.cr.col + cp->coloffset;
+        if (row >= 0 && col >= 0)
+            *top++ = scvalue_getcell(cp, row, col);
+        else
+            *top++ = scvalue_error(ERROR_REF);
+        VM_NEXT();
+    VM_CASE(VM_NODE):
+        *top++ = eval_node_value(cp, ip->u.e);
+        VM_NEXT();
+    VM_CASE(VM_ADD):
+        VM_ARITH(+);
+    VM_CASE(VM_SUB):
+        VM_ARITH(-);
+    VM_CASE(VM_MUL):
+        VM_ARITH(*);
+    VM_CASE(VM_DIV):
+        if (top[-2].type == SC_NUMBER && top[-1].type == SC_NUMBER && top[-1].u.v) {
+            top[-2].u.v /= top[-1].u.v;
+        } else {
+            double denom;
+            err = 0;
+            v = scvalue_num(top[-2], &err);
+            denom = scvalue_num(top[-1], &err);
+            if (!err && !denom)
+                err = ERROR_DIV0;
+            top[-2] = err ? scvalue_error(err) : scvalue_number(v / denom);
+        }
+        top--;
+        VM_NEXT();
+    VM_CASE(VM_NEG):
+        err = 0;
+        v = -scvalue_num(top[-1], &err);
+        top[-1] = err ? scvalue_error(err) : scvalue_number(v);
+        VM_NEXT();
+    VM_CASE(VM_FN1):
+        err = 0;
+        v = scvalue_num(top[-1], &err);
+        if (!err) {
+            errno = 0;
+            v = ((double (*)(double))ip->u.fun)(v);
+            if (errno) err = ERROR_NUM;
+        }
+        top[-1] = err ? scvalue_error(err) : scvalue_number(v);
+        VM_NEXT();
+    VM_CASE(VM_FN2): {
+            double a1;
+            err = 0;
+            v = scvalue_num(top[-2], &err);
+            a1 = scvalue_num(top[-1], &err);
+            top--;
+            if (!err) {
+                errno = 0;
+                v = ((double (*)(double, double))ip->u.fun)(v, a1);
+                if (errno) err = ERROR_NUM;
+            }
+            top[-1] = err ? scvalue_error(err) : scvalue_number(v);
+        }
+        VM_NEXT();
+    VM_CASE(VM_CMP):
+        t = scvalue_cmp(ip->arg, top[-2], top[-1]);
+        scvalue_free(top[-2]);
+        scvalue_free(top[-1]);
+        top--;
+        top[-1] = scvalue_boolean(t);
+        VM_NEXT();
+    VM_CASE(VM_NOT):
+        err = 0;
+        t = !scvalue_test(top[-1], &err);
+        top[-1] = err ? scvalue_error(err) : scvalue_boolean(t);
+        VM_NEXT();
+    VM_CASE(VM_TEST):
+        err = 0;
+        t = scvalue_test(top[-1], &err);
+        top[-1] = err ? scvalue_error(err) : scvalue_boolean(t);
+        VM_NEXT();
+    VM_CASE(VM_JFALSE):
+        err = 0;
+        t = scvalue_test(*--top, &err);
+        if (err) {
+            *top++ = scvalue_error(err);
+            ip = code + ip->u.label;
+            VM_DISPATCH();
+        }
+        if (!t) {
+            ip = code + ip->arg;
+            VM_DISPATCH();
+        }
+        VM_NEXT();
+    VM_CASE(VM_JUMP):
+        ip = code + ip->arg;
+        VM_DISPATCH();
+    VM_CASE(VM_RETURN):
+        return top[-1];
+    VM_END_SWITCH()
+#undef VM_ARITH
+}
+
+#undef VM_LABEL
+#undef VM_SWITCH
+#undef VM_END_SWITCH
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_NEXT
+
 /*---------------- spreadsheet recalc ----------------*/
 
 /*
- * The graph formed by cell expressions which use other cells's values is not
- * evaluated "bottom up".  The whole table is merely re-evaluated cell by cell,
- * top to bottom, left to right, in RealEvalAll().  Each cell's expression uses
- * constants in other cells.  However, RealEvalAll() notices when a cell gets a
- * new numeric or string value, and reports if this happens for any cell.
- * EvalAll() repeats calling RealEvalAll() until there are no changes or the
- * evaluation count expires.
+ * The graph formed by cell expressions which use other cells's values is
+ * evaluated "bottom up": EvalAll() gets the dependency graph of the sheet
+ * (see graph.c) and evaluates each formula once, after its precedents.
+ * Formulas on a cycle are iterated by EvalCycle(), one cycle at a time,
+ * until their values do not change or the iteration count expires.
+ * Formulas with references computed at run time and their dependents are
+ * re-evaluated cell by cell, in calc_order order, by RealEvalAll() which
+ * notices when a cell gets a new numeric or string value, and reports if
+ * this happens for any cell.  EvalAll() repeats calling RealEvalAll() until
+ * there are no changes or the evaluation count expires.
+ * The order is grouped in levels of formulas that do not depend on each
+ * other: with `set threads=n`, large levels are shared between a pool of
+ * threads that steal work from one another (see recalc_batch()).
+ * The interactive loop calls EvalSlice() to recalc for a limited time, the
+ * position reached in the order is kept in the graph to continue from it.
  */
 
 void set_iterations(sheet_t *sp, int i) {
@@ -3017,23 +4134,583 @@ void set_iterations(sheet_t *sp, int i) {
     } else {
         sp->propagation = i;
     }
+    depgraph_dirty_all(sp);
 }
 
-void EvalAll(sheet_t *sp) {
-    int lastcnt, pair, v, err = 0;
+#define EVAL_CHANGED  1     /* the cell value changed */
+#define EVAL_FPE      2     /* a floating point exception occurred */
 
-    signal(SIGFPE, eval_fpe);
+/* evaluate the formula e of cell p and store its value.  Return a
+   combination of EVAL_CHANGED and EVAL_FPE.  Only the cell and its
+   column mirror are modified: this is safe to call from recalc threads.
+   The floating point exception flags must be clear on entry, they are
+   cleared again if the formula raised one.
+ */
+static int eval_cell(eval_ctx_t *cp, struct ent *p, enode_t *e) {
+    scvalue_t res;
+    int flags = 0;
+
+    res = (e && (e->flags & ENODE_CODE)) ? vm_run(cp, enode_code(e)) :
+        eval_node_value(cp, e);
+    if (fetestexcept(FE_EVAL)) {
+        /* the flags may come from intermediary results that the formula
+           handled, such as @iserr(@sqrt(-1)) or 1/(1e308*10): only report
+           a fault if the final value is not finite.
+         */
+        feclearexcept(FE_EVAL);
+        if (res.type == SC_NUMBER && !isfinite(res.u.v))
+            flags = EVAL_FPE;
+    }
+    if (res.type == SC_NUMBER && !isfinite(res.u.v)) {
+        res = scvalue_error(ERROR_NUM);
+    }
+    if (p->type == res.type) {
+        if (res.type == SC_STRING) {
+            if (!strcmp(s2c(res.u.str), s2c(p->label))) {
+                scvalue_free(res);
+                return flags;
+            }
+        } else
+        if (res.type == SC_NUMBER || res.type == SC_BOOLEAN) {
+            if (res.u.v == p->v)
+                return flags;
+        } else
+        if (res.type == SC_ERROR) {
+            if (res.u.error == p->cellerror)
+                return flags;
+        } else {
+            /* res.type is SC_EMPTY */
+            return flags;
+        }
+    }
+    // XXX: cell value changes, should store undo record?
+    res = scvalue_own(res);
+    ent_clear_value(p);
+    p->type = res.type;
+    p->flags |= IS_CHANGED;
+    if (res.type == SC_STRING) {
+        p->label = res.u.str;
+    } else
+    if (res.type == SC_NUMBER || res.type == SC_BOOLEAN) {
+        p->v = res.u.v;
+    } else
+    if (res.type == SC_ERROR) {
+        p->cellerror = res.u.error;
+    }
+    colmirror_update(cp->sp, cp->gmyrow, cp->gmycol, p);
+    return flags | EVAL_CHANGED;
+}
 
-    for (repct = 1; (lastcnt = RealEvalAll(sp)) && repct < sp->propagation; repct++)
-        continue;
+/* evaluate node np of the order if needed, mark its dependents
+   dirty if its value changes.
+ */
+static void EvalNode(sheet_t *sp, depgraph_t *g, depnode_t *np) {
+    if (g->full || (np->flags & (DEP_DIRTY | DEP_VOLATILE))) {
+        np->flags &= ~DEP_DIRTY;
+        if (RealEvalOne(sp, np->p, np->p->expr, np->row, np->col, 1)) {
+            int d;
+            for (d = 0; d < np->ndeps; d++)
+                g->nodes[g->deps[np->deps + d]].flags |= DEP_DIRTY;
+        }
+    }
+}
 
-    if (sp->propagation > 1 && lastcnt > 0)
-        error("Still changing after %d iterations", repct);
+/* queue the node for EvalSparse() in a heap of order positions */
+static void sparse_push(depgraph_t *g, int *heap, int *np, int node) {
+    int i, pos = g->pos[node];
+
+    if (pos < 0 || (g->nodes[node].flags & DEP_QUEUED))
+        return;
+    g->nodes[node].flags |= DEP_QUEUED;
+    for (i = (*np)++; i > 0 && heap[(i - 1) / 2] > pos; i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = pos;
+}
+
+static int sparse_pop(int *heap, int *np) {
+    int i, j, pos = heap[0], last = heap[--*np];
+
+    for (i = 0; (j = 2 * i + 1) < *np; i = j) {
+        if (j + 1 < *np && heap[j + 1] < heap[j])
+            j++;
+        if (last <= heap[j])
+            break;
+        heap[i] = heap[j];
+    }
+    heap[i] = last;
+    return pos;
+}
+
+/* evaluate the dirty and volatile formulas of the ordered part of the
+   graph and their dependents in evaluation order, without visiting the
+   other formulas.  If too many formulas are affected or the deadline
+   passes, stop and return the position in g->order from which the levels
+   must be visited, the formulas left to evaluate being marked dirty.
+ */
+static int EvalSparse(sheet_t *sp, depgraph_t *g, double deadline) {
+    SCXMEM int *heap;
+    int i, d, pos, nheap = 0, count = 0, budget = g->norder / 16 + 256;
+
+    if (!g->norder || !(heap = scxmalloc(g->norder * sizeof(*heap))))
+        return 0;
+    for (i = 0; i < g->nvolatile; i++)
+        sparse_push(g, heap, &nheap, g->volatiles[i]);
+    for (i = 0; i < g->ndirty; i++) {
+        if (g->nodes[g->dirty[i]].flags & DEP_DIRTY)
+            sparse_push(g, heap, &nheap, g->dirty[i]);
+    }
+    while (nheap > 0 && count++ < budget) {
+        depnode_t *np;
+        if (deadline && !(count & 63) && sc_clock() >= deadline)
+            break;
+        np = &g->nodes[g->order[sparse_pop(heap, &nheap)]];
+        np->flags &= ~(DEP_QUEUED | DEP_DIRTY);
+        if (RealEvalOne(sp, np->p, np->p->expr, np->row, np->col, 1)) {
+            for (d = 0; d < np->ndeps; d++) {
+                int n = g->deps[np->deps + d];
+                g->nodes[n].flags |= DEP_DIRTY;
+                sparse_push(g, heap, &nheap, n);
+            }
+        }
+    }
+    pos = nheap ? heap[0] : g->norder;
+    for (i = 0; i < nheap; i++)
+        g->nodes[g->order[heap[i]]].flags &= ~DEP_QUEUED;
+    scxfree(heap);
+    return pos;
+}
+
+/* iterate the cycle of nodes g->rest[lo] to g->rest[hi-1] until
+   no value changes or the iteration count expires.  Return the number
+   of cells still changing on the last iteration.
+ */
+static int EvalCycle(sheet_t *sp, depgraph_t *g, int lo, int hi) {
+    int i, d, repct, chgct;
+
+    for (i = lo; !g->full && i < hi; i++) {
+        if (g->nodes[g->rest[i]].flags & (DEP_DIRTY | DEP_VOLATILE))
+            break;
+    }
+    if (i == hi)
+        return 0;
+
+    for (repct = 1;; repct++) {
+        chgct = 0;
+        for (i = lo; i < hi; i++) {
+            depnode_t *np = &g->nodes[g->rest[i]];
+            if (RealEvalOne(sp, np->p, np->p->expr, np->row, np->col, repct)) {
+                chgct++;
+                for (d = 0; d < np->ndeps; d++)
+                    g->nodes[g->deps[np->deps + d]].flags |= DEP_DIRTY;
+            }
+        }
+        if (!chgct || repct >= sp->propagation)
+            break;
+    }
+    if (sp->stats.iterations < repct)
+        sp->stats.iterations = repct;
+    for (i = lo; i < hi; i++)
+        g->nodes[g->rest[i]].flags &= ~DEP_DIRTY;
+    return chgct;
+}
+
+#ifdef SC_THREADS
+#define RECALC_MAXTHREADS  64
+#define RECALC_CHUNK       32   /* nodes taken at once from a work range */
+#define RECALC_MINLEVEL    256  /* smaller levels are evaluated serially */
+
+/* each thread owns a range of the level being evaluated.  It takes
+   chunks from the front of its range and when it is empty, steals the
+   second half of the range of another thread.  The main thread is w[0].
+ */
+typedef struct recalc_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;       /* protects next and end */
+    int next, end;              /* range of g->order left to evaluate */
+    int generation;             /* last batch processed */
+    int changed;                /* number of cells changed in the batch */
+    int evals;                  /* number of formulas evaluated */
+    int fpe;                    /* number of floating point exceptions */
+} recalc_worker_t;
+
+static struct recalc_pool {
+    int init;
+    pthread_mutex_t lock;
+    pthread_cond_t start;       /* a new batch is ready */
+    pthread_cond_t done;        /* the last worker finished the batch */
+    int nthreads;               /* number of workers, including the main thread */
+    int generation;             /* incremented for each batch */
+    int running;                /* threads still working on the batch */
+    int quit;
+    sheet_t *sp;
+    depgraph_t *g;
+    recalc_worker_t w[RECALC_MAXTHREADS];
+} pool;
+
+static int recalc_take(recalc_worker_t *wp, int *lop, int *hip) {
+    int n;
+
+    pthread_mutex_lock(&wp->lock);
+    n = wp->end - wp->next;
+    if (n > RECALC_CHUNK)
+        n = RECALC_CHUNK;
+    *lop = wp->next;
+    *hip = wp->next += n;
+    pthread_mutex_unlock(&wp->lock);
+    return n > 0;
+}
+
+static int recalc_steal(recalc_worker_t *wp) {
+    int i, n, lo = 0, hi = 0;
+
+    for (i = 1; i < pool.nthreads && lo == hi; i++) {
+        recalc_worker_t *vp = &pool.w[(wp - pool.w + i) % pool.nthreads];
+        pthread_mutex_lock(&vp->lock);
+        n = vp->end - vp->next;
+        if (n > 0) {
+            hi = vp->end;
+            lo = vp->end -= (n + 1) / 2;
+        }
+        pthread_mutex_unlock(&vp->lock);
+    }
+    if (lo == hi)
+        return 0;
+    pthread_mutex_lock(&wp->lock);
+    wp->next = lo;
+    wp->end = hi;
+    pthread_mutex_unlock(&wp->lock);
+    return 1;
+}
+
+static void recalc_work(recalc_worker_t *wp) {
+    sheet_t *sp = pool.sp;
+    depgraph_t *g = pool.g;
+    int i, d, lo, hi;
+
+    feclearexcept(FE_EVAL);
+    while (recalc_take(wp, &lo, &hi) || (recalc_steal(wp) && recalc_take(wp, &lo, &hi))) {
+        for (i = lo; i < hi; i++) {
+            depnode_t *np = &g->nodes[g->order[i]];
+            eval_ctx_t cp[1] = {{ sp, np->row, np->col, 0, 0, 1, 1 }};
+            int flags;
+
+            if ((np->flags & DEP_SERIAL)
+            ||  !(g->full || (np->flags & (DEP_DIRTY | DEP_VOLATILE))))
+                continue;
+            /* nodes of the same level do not depend on each other:
+               only the dependents flags are updated concurrently.
+             */
+            np->flags &= ~DEP_DIRTY;
+            wp->evals++;
+            flags = eval_cell(cp, np->p, np->p->expr);
+            if (flags & EVAL_FPE) {
+                np->flags |= DEP_FPE;
+                wp->fpe++;
+            }
+            if (flags & EVAL_CHANGED) {
+                wp->changed++;
+                for (d = 0; d < np->ndeps; d++) {
+                    __atomic_fetch_or(&g->nodes[g->deps[np->deps + d]].flags,
+                                      DEP_DIRTY, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+}
+
+static void *recalc_thread(void *arg) {
+    recalc_worker_t *wp = arg;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.quit && wp->generation == pool.generation)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        if (pool.quit)
+            break;
+        wp->generation = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+        recalc_work(wp);
+        pthread_mutex_lock(&pool.lock);
+        if (!--pool.running)
+            pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/* start the recalc threads, signals are left to the main thread */
+static void recalc_pool_start(int n) {
+    sigset_t set, oset;
+    int i;
+
+    if (!pool.init) {
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.start, NULL);
+        pthread_cond_init(&pool.done, NULL);
+        for (i = 0; i < RECALC_MAXTHREADS; i++)
+            pthread_mutex_init(&pool.w[i].lock, NULL);
+        pool.nthreads = 1;
+        pool.init = 1;
+    }
+    if (pool.nthreads >= n)
+        return;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+    while (pool.nthreads < n) {
+        recalc_worker_t *wp = &pool.w[pool.nthreads];
+        wp->generation = pool.generation;
+        if (pthread_create(&wp->thread, NULL, recalc_thread, wp)) {
+            error("Cannot start recalc thread: %s", strerror(errno));
+            break;
+        }
+        pool.nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+static void recalc_pool_stop(void) {
+    int i;
+
+    if (!pool.init || pool.nthreads <= 1)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 1; i < pool.nthreads; i++)
+        pthread_join(pool.w[i].thread, NULL);
+    pool.quit = 0;
+    pool.nthreads = 1;
+}
+
+/* prepare the column mirrors of a range for the recalc threads, and
+   their running totals if needed.
+ */
+static void range_prepare(eval_ctx_t *cp, rangeref_t rr, int totals) {
+    sheet_t *sp = cp->sp;
+    int c, maxc = rr.right.col < sp->maxcol ? rr.right.col : sp->maxcol;
+
+    if (!range_mirror(cp, rr) || !totals)
+        return;
+    for (c = rr.left.col; c <= maxc; c++) {
+        colmirror_t *mp = sp->colmirror[c];
+        if (mp->pvalid <= rr.right.row && mp->pvalid < mp->nrows)
+            colmirror_prefix(mp, rr.right.row + 1);
+    }
+}
+
+/* mark the lookup indexes and match bitmaps valid at the start of a
+   batch: the threads do not write cells in the ranges read by the
+   batch, so they stay valid until the end of the batch even if other
+   rows of their columns change.
+ */
+static void recalc_cache_mark(sheet_t *sp, int on) {
+    lookup_index_t *ip;
+    critmap_t *cmp;
+
+    for (ip = sp->lookup_cache; ip; ip = ip->next) {
+        colmirror_t *mp = sp->colmirror ? sp->colmirror[ip->col] : NULL;
+        ip->batch = on && ip->slots && mp && ip->version == mp->version;
+    }
+    for (cmp = sp->crit_cache; cmp; cmp = cmp->next)
+        cmp->batch = on && critmap_valid(sp, cmp);
+}
+
+/* evaluate the nodes lo to hi-1 of the order, a level of the graph,
+   with the thread pool.  The serial nodes are left to the caller.
+ */
+static void recalc_batch(sheet_t *sp, depgraph_t *g, int lo, int hi) {
+    eval_ctx_t cp[1] = {{ sp, 0, 0, 0, 0, 1, 0 }};
+    int i, r, n = pool.nthreads, fpe = 0;
+
+    /* the threads do not build column mirrors, lookup indexes nor
+       match bitmaps: prepare them for the ranges of the level so range
+       scans are the same as in serial.
+     */
+    for (i = lo; i < hi; i++) {
+        depnode_t *np = &g->nodes[g->order[i]];
+        if (g->full || (np->flags & (DEP_DIRTY | DEP_VOLATILE))) {
+            for (r = 0; r < np->nrefs; r++) {
+                range_prepare(cp, g->refs[np->refs + r].rr, np->flags & DEP_TOTALS);
+                if (np->flags & DEP_LOOKUP)
+                    lookup_prepare(cp, g->refs[np->refs + r].rr);
+            }
+            if (np->flags & DEP_CRITERIA)
+                criteria_prepare(cp, np->p->expr);
+        }
+    }
+    /* the threads may change rows of the mirrors, but not within the
+       ranges they read: running totals valid now stay consistent for
+       these ranges during the batch.
+     */
+    for (i = 0; sp->colmirror && i <= sp->maxcol; i++) {
+        colmirror_t *mp = sp->colmirror[i];
+        if (mp)
+            mp->pbatch = mp->valid ? mp->pvalid : 0;
+    }
+    recalc_cache_mark(sp, 1);
+    for (i = 0; i < n; i++) {
+        recalc_worker_t *wp = &pool.w[i];
+        wp->next = lo + (int)((long)(hi - lo) * i / n);
+        wp->end = lo + (int)((long)(hi - lo) * (i + 1) / n);
+        wp->changed = wp->evals = wp->fpe = 0;
+    }
+    pool.sp = sp;
+    pool.g = g;
+    scxmem_shared = 1;
+    pthread_mutex_lock(&pool.lock);
+    pool.generation++;
+    pool.running = n - 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    recalc_work(&pool.w[0]);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    scxmem_shared = 0;
+    recalc_cache_mark(sp, 0);
+
+    for (i = 0; i < n; i++) {
+        changed += pool.w[i].changed;
+        sp->stats.formulas += pool.w[i].evals;
+        fpe += pool.w[i].fpe;
+    }
+    for (i = lo; fpe && i < hi; i++) {
+        depnode_t *np = &g->nodes[g->order[i]];
+        if (np->flags & DEP_FPE) {
+            np->flags &= ~DEP_FPE;
+            error("Floating point exception at %s", cell_addr(sp, cellref(np->row, np->col)));
+            fpe--;
+        }
+    }
+}
+#endif
+
+void set_threads(sheet_t *sp, int n) {
+#ifdef SC_THREADS
+    if (n < 1 || n > RECALC_MAXTHREADS) {
+        error("thread count must be between 1 and %d", RECALC_MAXTHREADS);
+        n = n < 1 ? 1 : RECALC_MAXTHREADS;
+    }
+    if (n < pool.nthreads)
+        recalc_pool_stop();
+#else
+    if (n != 1) {
+        error("Warning: recalc threads unavailable");
+        n = 1;
+    }
+#endif
+    sp->threads = n;
+}
+
+static int RealEvalSlice(sheet_t *sp, double deadline) {
+    int lastcnt, pair, v, i, lev, repct, err = 0;
+    depgraph_t *g;
+
+    g = depgraph_get(sp);
+    if (!g || !g->pending) {
+        feclearexcept(FE_EVAL);
+        sp->stats.time = 0;
+        sp->stats.formulas = 0;
+        sp->stats.iterations = 1;
+#ifndef NOEXTFUNCS
+        ext_expire();
+#endif
+    }
+    if (g) {
+        if (!g->pending) {
+            /* evaluate all formulas after a change in the graph or on
+               request, otherwise only the dirty and volatile ones. The
+               dependents of a formula are marked dirty when its value
+               changes.
+             */
+            g->pending = 1;
+            g->nextblock = 0;
+            g->next = g->full ? 0 : EvalSparse(sp, g, deadline);
+        }
+#ifdef SC_THREADS
+        if (sp->threads > 1 && g->next < g->norder)
+            recalc_pool_start(sp->threads);
+#endif
+        for (lev = 0; lev < g->nlevels && g->next < g->norder; lev++) {
+            int lo = g->levels[lev], hi = g->levels[lev + 1];
+            if (hi <= g->next)
+                continue;
+            if (lo < g->next)
+                lo = g->next;
+            if (deadline && sc_clock() >= deadline)
+                return 0;
+#ifdef SC_THREADS
+            if (sp->threads > 1 && pool.nthreads > 1 && hi - lo >= RECALC_MINLEVEL && !sp->profile) {
+                /* a time slice ends between smaller batches, sized from
+                   the duration of the previous one */
+                int end, step = deadline ? RECALC_CHUNK * pool.nthreads : hi - lo;
+                for (; lo < hi; lo = end) {
+                    double t0 = sc_clock(), now;
+                    end = hi - lo > step ? lo + step : hi;
+                    recalc_batch(sp, g, lo, end);
+                    for (i = lo; i < end; i++) {
+                        if (g->nodes[g->order[i]].flags & DEP_SERIAL)
+                            EvalNode(sp, g, &g->nodes[g->order[i]]);
+                    }
+                    g->next = end;
+                    if (deadline && end < hi) {
+                        double n;
+                        if ((now = sc_clock()) >= deadline)
+                            return 0;
+                        n = now > t0 ? step * (deadline - now) / (now - t0) : hi - lo;
+                        step = n < pool.nthreads ? pool.nthreads : n < hi - lo ? (int)n : hi - lo;
+                    }
+                }
+                continue;
+            }
+#endif
+            for (i = lo; i < hi; i++) {
+                EvalNode(sp, g, &g->nodes[g->order[i]]);
+                if (deadline && !(i & 63) && sc_clock() >= deadline) {
+                    g->next = i + 1;
+                    return 0;
+                }
+            }
+            g->next = hi;
+        }
+        /* then the circular references and the formulas after them */
+        for (lastcnt = 0; g->nextblock < g->nblocks; g->nextblock++) {
+            depnode_t *np;
+            i = g->nextblock;
+            if (deadline && sc_clock() >= deadline)
+                break;
+            np = &g->nodes[g->rest[g->blocks[i]]];
+            if (np->flags & DEP_CYCLE)
+                lastcnt += EvalCycle(sp, g, g->blocks[i], g->blocks[i + 1]);
+            else
+                EvalNode(sp, g, np);
+        }
+        if (sp->propagation > 1 && lastcnt > 0)
+            error("Still changing after %d iterations", sp->propagation);
+        if (g->nextblock < g->nblocks)
+            return 0;
+        g->full = 0;
+        g->ndirty = 0;
+        g->pending = 0;
+    }
+    if (!g || g->ndynamic) {
+        for (repct = 1; (lastcnt = RealEvalAll(sp, g, repct)) && repct < sp->propagation; repct++)
+            continue;
+        if (sp->stats.iterations < repct)
+            sp->stats.iterations = repct;
+
+        if (sp->propagation > 1 && lastcnt > 0)
+            error("Still changing after %d iterations", repct);
+    }
 
     if (usecurses && color) {
         for (pair = 1; pair <= CPAIRS; pair++) {
             if (cpairs[pair] && cpairs[pair]->expr) {
-                eval_ctx_t cp[1] = {{ sp, 0, 0, 0, 0 }};
+                eval_ctx_t cp[1] = {{ sp, 0, 0, 0, 0, 1, 0 }};
                 v = eval_int(cp, cpairs[pair]->expr, 0, 0x77, &err);
                 if (!err) {
                     /* ignore value if expression error */
@@ -3049,24 +4726,59 @@ void EvalAll(sheet_t *sp) {
             }
         }
     }
-    signal(SIGFPE, doquit);
+#ifndef NOEXTFUNCS
+    /* without a screen to update, wait for the external commands and
+       evaluate the formulas again with their results */
+    if (!usecurses && ext_pending() && ext_wait(sp))
+        EvalAll(sp);
+#endif
+    return 1;
+}
+
+/* Start a recalc or continue the interrupted one for `ms` milliseconds at
+   most, or until it completes if ms < 0.  Return 1 if the recalc is
+   complete, 0 if it was interrupted.
+ */
+int EvalSlice(sheet_t *sp, int ms) {
+    double start = sc_clock();
+    int done = RealEvalSlice(sp, ms < 0 ? 0 : start + ms / 1000.0);
+
+    sp->stats.time += sc_clock() - start;
+    if (done) {
+        sp->stats.recalc_time = sp->stats.time;
+        sp->stats.recalc_formulas = sp->stats.formulas;
+        sp->stats.recalc_iterations = sp->stats.iterations;
+    }
+    return done;
+}
+
+void EvalAll(sheet_t *sp) {
+    EvalSlice(sp, -1);
 }
 
 /*
- * Evaluate all cells which have expressions and alter their numeric or string
- * values.  Return the number of cells which changed.
+ * Evaluate all cells which have expressions, or only those with dynamic
+ * references if the dependency graph is available, and alter their numeric
+ * or string values.  Return the number of cells which changed.
  */
 
-static int RealEvalAll(sheet_t *sp) {
+static int RealEvalAll(sheet_t *sp, depgraph_t *g, int numiter) {
     int i, j;
     int chgct = 0;
     struct ent *p;
 
+    if (g) {
+        for (i = g->nrest - g->ndynamic; i < g->nrest; i++) {
+            depnode_t *np = &g->nodes[g->rest[i]];
+            np->flags &= ~DEP_DIRTY;
+            chgct += RealEvalOne(sp, np->p, np->p->expr, np->row, np->col, numiter);
+        }
+    } else
     if (sp->calc_order == BYROWS) {
         for (i = 0; i <= sp->maxrow; i++) {
             for (j = 0; j <= sp->maxcol; j++) {
                 if ((p = getcell(sp, i, j)) && p->expr)
-                    chgct += RealEvalOne(sp, p, p->expr, i, j);
+                    chgct += RealEvalOne(sp, p, p->expr, i, j, numiter);
             }
         }
     } else
@@ -3074,91 +4786,84 @@ static int RealEvalAll(sheet_t *sp) {
         for (j = 0; j <= sp->maxcol; j++) {
             for (i = 0; i <= sp->maxrow; i++) {
                 if ((p = getcell(sp, i, j)) && p->expr)
-                    chgct += RealEvalOne(sp, p, p->expr, i, j);
+                    chgct += RealEvalOne(sp, p, p->expr, i, j, numiter);
             }
         }
     } else {
-        // XXX: Should implement topological sort
         error("Internal error calc_order");
     }
     return chgct;
 }
 
-static int RealEvalOne(sheet_t *sp, struct ent *p, enode_t *e, int row, int col) {
-    eval_ctx_t cp[1] = {{ sp, row, col, 0, 0 }};
-    scvalue_t res;
+static int RealEvalOne(sheet_t *sp, struct ent *p, enode_t *e, int row, int col, int numiter) {
+    eval_ctx_t cp[1] = {{ sp, row, col, 0, 0, numiter, 0 }};
+    int flags;
 
-    if (setjmp(fpe_save)) {
-        error("Floating point exception at %s", cell_addr(sp, cellref(row, col)));
-        res = scvalue_error(ERROR_NUM);
+    sp->stats.formulas++;
+    if (sp->profile) {
+        double t0 = sc_clock();
+        flags = eval_cell(cp, p, e);
+        profile_cell(row, col, sc_clock() - t0);
     } else {
-        res = eval_node_value(cp, e);
-    }
-    if (res.type == SC_NUMBER && !isfinite(res.u.v)) {
-        res = scvalue_error(ERROR_NUM);
-    }
-    if (p->type == res.type) {
-        if (res.type == SC_STRING) {
-            if (!strcmp(s2c(res.u.str), s2c(p->label))) {
-                string_free(res.u.str);
-                return 0;
-            }
-        } else
-        if (res.type == SC_NUMBER || res.type == SC_BOOLEAN) {
-            if (res.u.v == p->v)
-                return 0;
-        } else
-        if (res.type == SC_ERROR) {
-            if (res.u.error == p->cellerror)
-                return 0;
-        } else {
-            /* res.type is SC_EMPTY */
-            return 0;
-        }
-    }
-    // XXX: cell value changes, should store undo record?
-    if (p->type == SC_STRING) {
-        string_set(&p->label, NULL); /* free the previous label */
+        flags = eval_cell(cp, p, e);
     }
-    p->type = res.type;
-    p->cellerror = 0;
-    p->flags |= IS_CHANGED;
-    p->v = 0;
-    changed++;
-    if (res.type == SC_STRING) {
-        string_set(&p->label, res.u.str);
-    } else
-    if (res.type == SC_NUMBER || res.type == SC_BOOLEAN) {
-        p->v = res.u.v;
-    } else
-    if (res.type == SC_ERROR) {
-        p->cellerror = res.u.error;
+
+    if (flags & EVAL_FPE)
+        error("Floating point exception at %s", cell_addr(sp, cellref(row, col)));
+    if (flags & EVAL_CHANGED) {
+        changed++;
+        return 1;
     }
-    return 1;
+    return 0;
 }
 
 /* set the calculation order */
 void set_calcorder(sheet_t *sp, int i) {
-    if (i == BYROWS || i == BYCOLS)
+    if ((i == BYROWS || i == BYCOLS) && sp->calc_order != i) {
         sp->calc_order = i;
+        depgraph_invalidate(sp);
+    }
 }
 
 void set_autocalc(sheet_t *sp, int i) {
+    /* the interactive loop only continues the recalc with autocalc */
+    if (!i && depgraph_pending(sp))
+        EvalAll(sp);
     sp->autocalc = i;
 }
 
 /*---------------- expression tree construction ----------------*/
 
+/* size of an expression node with nargs arguments */
+static size_t enode_size(int nargs) {
+    size_t size = offsetof(enode_t, e);
+    if (nargs > 0) size += sizeof(((enode_t *)0)->e.args[0]) * nargs;
+    if (size < sizeof(enode_t)) size = sizeof(enode_t);
+    /* keep packed nodes properly aligned */
+    return (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+}
+
+/* expression nodes are only allocated and freed by the main thread */
+static SCXMEM void *enode_alloc(size_t size) {
+    SCXMEM void *p = scxmalloc(size);
+    scxmem_enodes += scxmem_size(p);
+    return p;
+}
+
+static void enode_free(SCXMEM void *p) {
+    scxmem_enodes -= scxmem_size(p);
+    scxfree(p);
+}
+
 static SCXMEM enode_t *new_node(int op, int nargs) {
     SCXMEM enode_t *p;
-    size_t size = offsetof(enode_t, e);
     int i;
 
-    if (nargs > 0) size += sizeof(p->e.args) * nargs;
-    p = scxmalloc(size > sizeof(enode_t) ? size : sizeof(enode_t));
+    p = enode_alloc(enode_size(nargs));
     if (p) {
         p->op = op;
         p->type = OP_TYPE_FUNC;
+        p->flags = 0;
         p->nargs = nargs;
         for (i = 0; i < nargs; i++) {
             p->e.args[i] = NULL;
@@ -3175,7 +4880,7 @@ SCXMEM enode_t *new_op1(int op, SCXMEM enode_t *a1) {
     SCXMEM enode_t *e = new_node(op, 1);
     if (!e || !a1) {
         efree(a1);
-        scxfree(e);
+        enode_free(e);
         return NULL;
     }
     e->e.args[0] = a1;
@@ -3187,7 +4892,7 @@ SCXMEM enode_t *new_op2(int op, SCXMEM enode_t *a1, SCXMEM enode_t *a2) {
     if (!e || !a1 || !a2) {
         efree(a1);
         efree(a2);
-        scxfree(e);
+        enode_free(e);
         return NULL;
     }
     e->e.args[0] = a1;
@@ -3218,7 +4923,7 @@ SCXMEM enode_t *new_op1x(int op, SCXMEM enode_t *a1, SCXMEM enode_t *a2) {
     for (p = a2; p && p->op == OP_COMMA_;) {
         for (j = 0; j < p->nargs; j++)
             e->e.args[i++] = p->e.args[j];
-        scxfree(p);
+        enode_free(p);
         p = e->e.args[--i];
     }
     if (p) {
@@ -3236,7 +4941,7 @@ SCXMEM enode_t *new_op3(int op, SCXMEM enode_t *a1, SCXMEM enode_t *a2,
         efree(a1);
         efree(a2);
         efree(a3);
-        scxfree(e);
+        enode_free(e);
         return NULL;
     }
     e->e.args[0] = a1;
@@ -3246,10 +4951,11 @@ SCXMEM enode_t *new_op3(int op, SCXMEM enode_t *a1, SCXMEM enode_t *a2,
 }
 
 SCXMEM enode_t *new_var(sheet_t *sp, cellref_t cr) {
-    SCXMEM enode_t *p = scxmalloc(sizeof(enode_t));
+    SCXMEM enode_t *p = enode_alloc(sizeof(enode_t));
     if (p) {
         p->op = OP__VAR;
         p->type = OP_TYPE_VAR;
+        p->flags = 0;
         p->nargs = 0;
         p->e.cr = cr;
     }
@@ -3257,10 +4963,11 @@ SCXMEM enode_t *new_var(sheet_t *sp, cellref_t cr) {
 }
 
 SCXMEM enode_t *new_range(sheet_t *sp, rangeref_t rr) {
-    SCXMEM enode_t *p = scxmalloc(sizeof(enode_t));
+    SCXMEM enode_t *p = enode_alloc(sizeof(enode_t));
     if (p) {
         p->op = OP__RANGE;
         p->type = OP_TYPE_RANGE;
+        p->flags = 0;
         p->nargs = 0;
         p->e.rr = rr;
     }
@@ -3268,10 +4975,11 @@ SCXMEM enode_t *new_range(sheet_t *sp, rangeref_t rr) {
 }
 
 SCXMEM enode_t *new_const(double v) {
-    SCXMEM enode_t *p = scxmalloc(sizeof(enode_t));
+    SCXMEM enode_t *p = enode_alloc(sizeof(enode_t));
     if (p) {
         p->op = OP__NUMBER;
         p->type = OP_TYPE_DOUBLE;
+        p->flags = 0;
         p->nargs = 0;
         p->e.k = v;
         if (!isfinite(v)) {
@@ -3284,10 +4992,11 @@ SCXMEM enode_t *new_const(double v) {
 }
 
 SCXMEM enode_t *new_error(int error) {
-    SCXMEM enode_t *p = scxmalloc(sizeof(enode_t));
+    SCXMEM enode_t *p = enode_alloc(sizeof(enode_t));
     if (p) {
         p->op = OP__ERROR;
         p->type = OP_TYPE_ERROR;
+        p->flags = 0;
         p->nargs = 0;
         p->e.error = error;
     }
@@ -3295,10 +5004,11 @@ SCXMEM enode_t *new_error(int error) {
 }
 
 SCXMEM enode_t *new_str(SCXMEM string_t *s) {
-    SCXMEM enode_t *p = scxmalloc(sizeof(enode_t));
+    SCXMEM enode_t *p = enode_alloc(sizeof(enode_t));
     if (p) {
         p->op = OP__STRING;
         p->type = OP_TYPE_STRING;
+        p->flags = 0;
         p->nargs = 0;
         p->e.s = s;
     }
@@ -3423,12 +5133,14 @@ void unlet(sheet_t *sp, cellref_t cr) {
     struct ent *p = getcell(sp, cr.row, cr.col);
     if (p && p->type != SC_EMPTY) {
         // XXX: what if the cell is locked?
-        string_set(&p->label, NULL);
-        efree(p->expr);
-        p->expr = NULL;
-        p->type = SC_EMPTY;
-        p->cellerror = 0;
-        p->v = 0.0;
+        ent_clear_value(p);
+        if (p->expr) {
+            efree(p->expr);
+            p->expr = NULL;
+            depgraph_edit(sp, cr.row, cr.col);
+        }
+        colmirror_update(sp, cr.row, cr.col, p);
+        depgraph_dirty(sp, cr.row, cr.col);
         p->flags |= IS_CHANGED;
         FullUpdate++;
         changed++;
@@ -3472,17 +5184,20 @@ void let(sheet_t *sp, cellref_t cr, SCXMEM enode_t *e, int align) {
 
     // XXX: test for constant expression is potentially incorrect
     if (!loading || isconstant) {
-        signal(SIGFPE, eval_fpe);
-        RealEvalOne(sp, v, e, cr.row, cr.col);
-        signal(SIGFPE, doquit);
+        feclearexcept(FE_EVAL);
+        RealEvalOne(sp, v, e, cr.row, cr.col, 1);
     }
 
     if (isconstant) {
         efree(e);
         e = NULL;
     }
+    if (v->expr || e)
+        depgraph_edit(sp, cr.row, cr.col);
+    else
+        depgraph_dirty(sp, cr.row, cr.col);
     efree(v->expr);
-    v->expr = e;
+    v->expr = enode_pack(e);
     v->flags |= IS_CHANGED;
     if (align >= 0) {
         v->flags &= ~ALIGN_MASK;
@@ -3506,7 +5221,106 @@ void efree(SCXMEM enode_t *e) {
         if (e->type == OP_TYPE_STRING) {
             string_free(e->e.s);
         }
-        scxfree(e);
+        /* nodes inside a packed block are freed with the block head */
+        if (!(e->flags & ENODE_PACKED) || (e->flags & ENODE_BLOCK))
+            enode_free(e);
+    }
+}
+
+/*---------------- packed expression trees ----------------*/
+
+static size_t enode_tree_size(enode_t *e) {
+    size_t size = 0;
+    if (e) {
+        size = enode_size(e->type == OP_TYPE_FUNC ? e->nargs : 0);
+        if (e->type == OP_TYPE_FUNC) {
+            int i;
+            for (i = 0; i < e->nargs; i++)
+                size += enode_tree_size(e->e.args[i]);
+        }
+    }
+    return size;
+}
+
+/* copy a tree in prefix order at *pp, advance *pp past the copy.
+   extra bytes are reserved after the node, before its arguments.
+ */
+static enode_t *enode_pack_node(enode_t *e, char **pp, size_t extra) {
+    enode_t *n;
+    int i;
+
+    if (!e)
+        return NULL;
+    n = (enode_t *)(void *)*pp;
+    *pp += enode_size(e->type == OP_TYPE_FUNC ? e->nargs : 0) + extra;
+    n->op = e->op;
+    n->type = e->type;
+    n->flags = ENODE_PACKED;
+    n->nargs = e->nargs;
+    switch (e->type) {
+    case OP_TYPE_FUNC:
+        for (i = 0; i < e->nargs; i++)
+            n->e.args[i] = enode_pack_node(e->e.args[i], pp, 0);
+        break;
+    case OP_TYPE_STRING:
+        n->e.s = string_dup(e->e.s);
+        break;
+    default:
+        n->e = e->e;
+        break;
+    }
+    return n;
+}
+
+/* store an expression tree in a single memory block, in prefix order
+   so evaluation walks adjacent memory. The original tree is freed.
+   Nodes added later to a packed tree (eg: by @ext) are heap allocated
+   and freed separately by efree().
+   The bytecode for the formula is stored between the root node and its
+   arguments, so evaluation only touches the start of the block.
+ */
+SCXMEM enode_t *enode_pack(SCXMEM enode_t *e) {
+    vmcomp_t vc = { NULL, 0, 0, 0, 0 };
+    size_t size;
+    size_t extra = 0;
+    char *block, *p;
+    enode_t *n;
+
+    if (!e || e->type != OP_TYPE_FUNC || (e->flags & ENODE_BLOCK))
+        return e;
+    size = enode_tree_size(e);
+    /* only compile formulas with at least one inline operation */
+    vm_compile(&vc, e);
+    if (vc.pc > 1 && vc.maxdepth <= VM_MAXSTACK) {
+        /* room for VM_NUMERIC and VM_RETURN */
+        extra = (vc.pc + 1 + !vc.other) * sizeof(vminstr_t);
+        size += extra;
+    }
+    if (!(block = enode_alloc(size)))
+        return e;
+    p = block;
+    n = enode_pack_node(e, &p, extra);
+    n->flags |= ENODE_BLOCK;
+    if (extra) {
+        n->flags |= ENODE_CODE;
+        if (!vc.other)
+            n->flags |= ENODE_NUMERIC;
+        enode_compile(n);
+    }
+    efree(e);
+    return n;
+}
+
+/* update the bytecode of a packed formula after its references have
+   been modified in place.
+ */
+void enode_compile(enode_t *e) {
+    if (e && (e->flags & ENODE_CODE)) {
+        vmcomp_t vc = { enode_code(e), 0, 0, 0, 0 };
+        if (e->flags & ENODE_NUMERIC)
+            vm_emit(&vc, VM_NUMERIC, 0, 0);
+        vm_compile(&vc, e);
+        vm_emit(&vc, VM_RETURN, 0, 0);
     }
 }
 
@@ -3699,6 +5513,8 @@ int decompile(sheet_t *sp, char *dest, size_t size, enode_t *e, int dr, int dc,
     return decompile_expr(sp, buf, e, dr, dc, flags);
 }
 
+/* recalc the formulas affected by the changes since the last recalc
+   and the volatile ones */
 void cmd_recalc(sheet_t *sp) {
     EvalAll(sp);
     update(sp, 1);
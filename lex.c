@@ -255,6 +255,7 @@ static int lookup_fname(const char *p, int len, int *pop) {
                         if (opp->max == -1) return FUNC2x;
                         break;
             case 3:     if (opp->max == 3) return FUNC3;
+                        if (opp->max == -1) return FUNC3x;
                         if (opp->max == 4) return FUNC34;
                         if (opp->max == 5) return FUNC35;
                         break;
@@ -185,8 +185,8 @@ static int search_match(search_ctx_t *sc, int row, int col, struct ent *p) {
                     s1 = boolean_name[!!p->v];
                 } else
                 if (p->type == SC_NUMBER) {
-                    if (p->format) {
-                        format(field, sizeof field, s2c(p->format), sp->colfmt[col].precision, p->v, &align);
+                    if (p->flags & HAS_FORMAT) {
+                        format(field, sizeof field, s2c(ent_format(p)), sp->colfmt[col].precision, p->v, &align);
                     } else {
                         engformat(field, sizeof field, sp->colfmt[col].realfmt, sp->colfmt[col].precision, p->v, &align);
                     }
@@ -465,12 +465,12 @@ __( OP_LOGNORMDIST,     1, 1, NULL, NULL, "LOGNORMDIST(x, mean, standard_deviati
 OP( OP_MAX,             1, -1, eval_max, NULL, "MAX(value1, [value2, ...])", "Returns the maximum value in a numeric dataset")
 OP( OP_MAXA,            1, -1, eval_max, NULL, "MAXA(value1, [value2, ...])", "Returns the maximum numeric value in a dataset")
 XX( OP_MAXIF,           2, 2, eval_maxif, NULL, "MAXIF(range, criteria_range1)", "Returns the maximum value in a numeric dataset")
-OP( OP_MAXIFS,          1, 1, eval_maxif, NULL, "MAXIFS(range, criteria_range1, criterion1, [criteria_range2, criterion2], ...)", "Returns the maximum value in a range of cells, filtered by a set of criteria.")
+OP( OP_MAXIFS,          3, -1, eval_maxif, NULL, "MAXIFS(range, criteria_range1, criterion1, [criteria_range2, criterion2], ...)", "Returns the maximum value in a range of cells, filtered by a set of criteria.")
 __( OP_MEDIAN,          1, -1, NULL, NULL, "MEDIAN(value1, [value2, ...])", "Returns the median value in a numeric dataset")
 OP( OP_MIN,             1, -1, eval_min, NULL, "MIN(value1, [value2, ...])", "Returns the minimum value in a numeric dataset")
 OP( OP_MINA,            1, -1, eval_min, NULL, "MINA(value1, [value2, ...])", "Returns the minimum numeric value in a dataset")
 XX( OP_MINIF,           2, 2, eval_minif, NULL, "MINIF(range, criteria_range1)", "Returns the maximum value in a numeric dataset")
-OP( OP_MINIFS,          1, 1, eval_minif, NULL, "MINIFS(range, criteria_range1, criterion1, [criteria_range2, criterion2], ...)", "Returns the minimum value in a range of cells, filtered by a set of criteria.")
+OP( OP_MINIFS,          3, -1, eval_minif, NULL, "MINIFS(range, criteria_range1, criterion1, [criteria_range2, criterion2], ...)", "Returns the minimum value in a range of cells, filtered by a set of criteria.")
 __( OP_MODE,            1, -1, NULL, NULL, "MODE(value1, [value2, ...])", "Returns the most commonly occurring value in a dataset")
 __( OP_MODE_MULT,       1, 1, NULL, NULL, "MODE.MULT(value1, value2)", "Returns the most commonly occurring values in a dataset.")
 __( OP_MODE_SNGL,       1, 1, NULL, NULL, "MODE.SNGL(value1, [value2, ...])", "See MODE")
@@ -54,8 +54,8 @@ void cmd_fgetnum(sheet_t *sp, rangeref_t rr, int fd) {
             if (p) {
                 switch (p->type) {
                 case SC_NUMBER:
-                    if (p->format) {
-                        format(buf, sizeof(buf) - 1, s2c(p->format), sp->colfmt[c].precision, p->v, &align);
+                    if (p->flags & HAS_FORMAT) {
+                        format(buf, sizeof(buf) - 1, s2c(ent_format(p)), sp->colfmt[c].precision, p->v, &align);
                     } else {
                         engformat(buf, sizeof(buf) - 1, sp->colfmt[c].realfmt, sp->colfmt[c].precision, p->v, &align);
                     }
@@ -134,8 +134,8 @@ void cmd_getfmt(sheet_t *sp, rangeref_t rr, int fd) {
         for (c = rr.left.col; c <= rr.right.col; c++) {
             struct ent *p = getcell(sp, r, c);
             *buf = '\0';
-            if (p && p->format)
-                snprintf(buf, sizeof buf - 1, "%s", s2c(p->format));
+            if (p && (p->flags & HAS_FORMAT))
+                snprintf(buf, sizeof buf - 1, "%s", s2c(ent_format(p)));
             len = pstrcat(buf, sizeof buf, (c < rr.right.col) ? "\t" : "\n");
             write(fd, buf, len);
             if (brokenpipe)
@@ -248,6 +248,69 @@ void cmd_status(sheet_t *sp, int fd) {
     write(fd, buf, p - buf);
 }
 
+/* list the engine statistics, one `name value` line each, terminated
+   by an empty line.  Durations are in seconds.
+ */
+void cmd_stats(sheet_t *sp, int fd) {
+    scstats_t *st = &sp->stats;
+    entslab_t *slab;
+    struct ent *p;
+    char buf[FBUFLEN];
+    long ncells = 0, nfree = 0;
+
+    for (slab = sp->cells.slabs; slab; slab = slab->next)
+        ncells += ENT_SLAB_SIZE;
+    if (sp->cells.slabs)
+        ncells -= sp->cells.avail;
+    for (p = sp->cells.free_ents; p; p = p->next)
+        nfree++;
+    snprintf(buf, sizeof buf,
+             "recalc_time %.6f\n"
+             "recalc_formulas %ld\n"
+             "recalc_iterations %d\n"
+             "cells_allocated %ld\n"
+             "cells_free %ld\n"
+             "string_bytes %zu\n"
+             "enode_bytes %zu\n"
+             "memory_bytes %zu\n"
+             "load_time %.6f\n"
+             "save_time %.6f\n"
+             "\n",
+             st->recalc_time, st->recalc_formulas, st->recalc_iterations,
+             ncells, nfree, scxmem_strings, scxmem_enodes, scxmem_requested,
+             st->load_time, st->save_time);
+    write(fd, buf, strlen(buf));
+}
+
+/* list the circular references, one line of cell addresses per cycle,
+   terminated by an empty line.
+ */
+void cmd_cycles(sheet_t *sp, int fd) {
+    depgraph_t *g = depgraph_get(sp);
+    char buf[FBUFLEN];
+    int i, j, len;
+
+    for (i = 0; g && i < g->nblocks; i++) {
+        depnode_t *np = &g->nodes[g->rest[g->blocks[i]]];
+        if (!(np->flags & DEP_CYCLE))
+            continue;
+        len = 0;
+        for (j = g->blocks[i]; j < g->blocks[i + 1]; j++) {
+            np = &g->nodes[g->rest[j]];
+            if (len > (int)sizeof(buf) - 24) {
+                write(fd, buf, len);
+                len = 0;
+            }
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%s",
+                            j > g->blocks[i] ? " " : "",
+                            cell_addr(sp, cellref(np->row, np->col)));
+        }
+        buf[len++] = '\n';
+        write(fd, buf, len);
+    }
+    write(fd, "\n", 1);
+}
+
 void cmd_whereami(sheet_t *sp, int fd) {
     char buf[64];
     snprintf(buf, sizeof buf, "%s %s\n",
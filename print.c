@@ -98,8 +98,8 @@ void printfile(sheet_t *sp, SCXMEM string_t *str, rangeref_t rr) {
                     if (!align)
                         align = ALIGN_CENTER;
                 } else {
-                    if (p->format) {
-                        len = format(field, sizeof field, s2c(p->format), sp->colfmt[col].precision, p->v, &align);
+                    if (p->flags & HAS_FORMAT) {
+                        len = format(field, sizeof field, s2c(ent_format(p)), sp->colfmt[col].precision, p->v, &align);
                     } else {
                         len = engformat(field, sizeof field, sp->colfmt[col].realfmt, sp->colfmt[col].precision, p->v, &align);
                     }
@@ -367,8 +367,8 @@ void tblprintfile(sheet_t *sp, SCXMEM string_t *str, rangeref_t rr) {
                         if (!align)
                             align = ALIGN_CENTER;
                     } else {
-                        if (p->format) {
-                            format(field, sizeof field, s2c(p->format), sp->colfmt[col].precision, p->v, &align);
+                        if (p->flags & HAS_FORMAT) {
+                            format(field, sizeof field, s2c(ent_format(p)), sp->colfmt[col].precision, p->v, &align);
                         } else {
                             engformat(field, sizeof field, sp->colfmt[col].realfmt, sp->colfmt[col].precision, p->v, &align);
                         }
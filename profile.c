@@ -0,0 +1,266 @@
+/*      SC      A Spreadsheet Calculator
+ *              Recalc profiler
+ *
+ *              With `set profile`, RealEvalOne() records the number of
+ *              evaluations and the time spent in each formula, and
+ *              eval_node() the time spent in each function along with
+ *              the ranges passed to it.  The `profile` command lists
+ *              the hottest cells, functions and ranges.
+ *
+ *              $Revision: 9.1 $
+ */
+
+#include "sc.h"
+
+#define PROF_TOP  20    /* default number of entries per section */
+
+typedef struct profent {
+    int next;                   /* hash chain: index in prof.tab or -1 */
+    int op;                     /* function scanning the range, -1 for a cell */
+    rangeref_t rr;              /* formula cell or range */
+    long count;
+    double time;                /* cumulative seconds */
+} profent_t;
+
+static struct profile {
+    SCXMEM profent_t *tab;
+    SCXMEM int *hash;
+    int count;                  /* entries in use */
+    int size;                   /* entries allocated, also the hash size */
+    long cells;                 /* formulas evaluated */
+    double time;                /* time spent evaluating them */
+    long opcount[OP_count];
+    double optime[OP_count];    /* including the nested functions */
+    double opself[OP_count];    /* excluding the nested functions */
+} prof;
+
+void profile_clean(void) {
+    scxfree(prof.tab);
+    scxfree(prof.hash);
+    memset(&prof, 0, sizeof prof);
+}
+
+/* start a new profile when profiling is turned on, the next recalc
+   evaluates all the formulas */
+void set_profile(sheet_t *sp, int on) {
+    if (on && !sp->profile) {
+        profile_clean();
+        depgraph_dirty_all(sp);
+    }
+    sp->profile = on;
+}
+
+static unsigned int prof_hash(int op, rangeref_t rr) {
+    unsigned int h = (unsigned int)op;
+    h = h * 31 + rr.left.row;
+    h = h * 31 + rr.left.col;
+    h = h * 31 + rr.right.row;
+    h = h * 31 + rr.right.col;
+    h *= 2654435761U;
+    return h ^ (h >> 16);
+}
+
+static int prof_grow(void) {
+    int i, size = prof.size ? prof.size * 2 : 1024;
+    SCXMEM profent_t *tab;
+    SCXMEM int *hash;
+
+    if (!(tab = scxrealloc(prof.tab, size * sizeof(*tab))))
+        return 0;
+    prof.tab = tab;
+    if (!(hash = scxmalloc(size * sizeof(*hash))))
+        return 0;
+    scxfree(prof.hash);
+    prof.hash = hash;
+    prof.size = size;
+    for (i = 0; i < size; i++)
+        hash[i] = -1;
+    for (i = 0; i < prof.count; i++) {
+        unsigned int h = prof_hash(tab[i].op, tab[i].rr) & (size - 1);
+        tab[i].next = hash[h];
+        hash[h] = i;
+    }
+    return 1;
+}
+
+/* find or create the entry for a cell (op < 0) or a range */
+static profent_t *prof_find(int op, rangeref_t rr) {
+    unsigned int h = prof_hash(op, rr);
+    profent_t *pp;
+    int i;
+
+    if (prof.size) {
+        for (i = prof.hash[h & (prof.size - 1)]; i >= 0; i = pp->next) {
+            pp = &prof.tab[i];
+            if (pp->op == op
+            &&  pp->rr.left.row == rr.left.row && pp->rr.left.col == rr.left.col
+            &&  pp->rr.right.row == rr.right.row && pp->rr.right.col == rr.right.col)
+                return pp;
+        }
+    }
+    if (prof.count == prof.size && !prof_grow())
+        return NULL;
+    h &= prof.size - 1;
+    pp = &prof.tab[prof.count];
+    pp->next = prof.hash[h];
+    pp->op = op;
+    pp->rr = rr;
+    pp->count = 0;
+    pp->time = 0;
+    prof.hash[h] = prof.count++;
+    return pp;
+}
+
+/* record the evaluation of the formula of a cell */
+void profile_cell(int row, int col, double t) {
+    cellref_t cr = cellref(row, col);
+    profent_t *pp = prof_find(-1, rangeref2(cr, cr));
+
+    prof.cells++;
+    prof.time += t;
+    if (pp) {
+        pp->count++;
+        pp->time += t;
+    }
+}
+
+/* record a call to the function of node e: t is the time of the call,
+   self excludes the nested functions.  The time is also attributed to
+   the ranges given as arguments.
+ */
+void profile_op(enode_t *e, double t, double self) {
+    profent_t *pp;
+    int i;
+
+    prof.opcount[e->op]++;
+    prof.optime[e->op] += t;
+    prof.opself[e->op] += self;
+    for (i = 0; i < e->nargs; i++) {
+        if (e->e.args[i] && e->e.args[i]->type == OP_TYPE_RANGE
+        &&  (pp = prof_find(e->op, e->e.args[i]->e.rr))) {
+            pp->count++;
+            pp->time += t;
+        }
+    }
+}
+
+static const char *prof_opname(int op) {
+    static char buf[32];
+    const char *name = opdefs[op].name;
+    int i;
+
+    if (!name) {
+        snprintf(buf, sizeof buf, "op%d", op);
+        return buf;
+    }
+    buf[0] = '@';
+    for (i = 1; i < (int)sizeof(buf) - 1 && *name && *name != '('; i++)
+        buf[i] = tolowerchar(*name++);
+    buf[i] = '\0';
+    return buf;
+}
+
+static int prof_cmp(const void *a, const void *b) {
+    double ta = (*(profent_t * const *)a)->time;
+    double tb = (*(profent_t * const *)b)->time;
+    return (ta < tb) - (ta > tb);
+}
+
+static int prof_opcmp(const void *a, const void *b) {
+    double ta = prof.opself[*(const int *)a];
+    double tb = prof.opself[*(const int *)b];
+    return (ta < tb) - (ta > tb);
+}
+
+static void profile_list(sheet_t *sp, FILE *f, int n) {
+    SCXMEM profent_t **cells = NULL;
+    SCXMEM profent_t **ranges = NULL;
+    int ops[OP_count];
+    int i, ncells = 0, nranges = 0, nops = 0;
+
+    if (prof.count) {
+        cells = scxmalloc(prof.count * sizeof(*cells));
+        ranges = scxmalloc(prof.count * sizeof(*ranges));
+        if (!cells || !ranges) {
+            scxfree(cells);
+            scxfree(ranges);
+            error("Not enough memory for the profile");
+            return;
+        }
+        for (i = 0; i < prof.count; i++) {
+            if (prof.tab[i].op < 0)
+                cells[ncells++] = &prof.tab[i];
+            else
+                ranges[nranges++] = &prof.tab[i];
+        }
+        qsort(cells, ncells, sizeof(*cells), prof_cmp);
+        qsort(ranges, nranges, sizeof(*ranges), prof_cmp);
+    }
+    for (i = 0; i < OP_count; i++) {
+        if (prof.opcount[i])
+            ops[nops++] = i;
+    }
+    qsort(ops, nops, sizeof(*ops), prof_opcmp);
+
+    fprintf(f, "\nRecalc profile: %ld formulas evaluated in %.0f ns\n",
+            prof.cells, prof.time * 1e9);
+    if (!brokenpipe) {
+        fprintf(f, "\n%-12s %10s %16s %12s\n", "Cell", "Count", "Total ns", "Average ns");
+        for (i = 0; i < ncells && i < n && !brokenpipe; i++) {
+            profent_t *pp = cells[i];
+            fprintf(f, "%-12s %10ld %16.0f %12.0f\n", cell_addr(sp, pp->rr.left),
+                    pp->count, pp->time * 1e9, pp->time * 1e9 / pp->count);
+        }
+    }
+    if (!brokenpipe) {
+        fprintf(f, "\n%-12s %10s %16s %16s\n", "Function", "Count", "Total ns", "Self ns");
+        for (i = 0; i < nops && i < n && !brokenpipe; i++) {
+            fprintf(f, "%-12s %10ld %16.0f %16.0f\n", prof_opname(ops[i]),
+                    prof.opcount[ops[i]], prof.optime[ops[i]] * 1e9,
+                    prof.opself[ops[i]] * 1e9);
+        }
+    }
+    if (!brokenpipe) {
+        fprintf(f, "\n%-24s %-12s %10s %16s\n", "Range", "Function", "Count", "Total ns");
+        for (i = 0; i < nranges && i < n && !brokenpipe; i++) {
+            profent_t *pp = ranges[i];
+            fprintf(f, "%-24s %-12s %10ld %16.0f\n", range_addr(sp, pp->rr),
+                    prof_opname(pp->op), pp->count, pp->time * 1e9);
+        }
+    }
+    scxfree(cells);
+    scxfree(ranges);
+}
+
+/* list the n hottest cells, functions and ranges of the profile to the
+   file or pipe fname, or to the pager if fname is NULL.
+ */
+void cmd_profile(sheet_t *sp, int n, SCXMEM string_t *fname) {
+    char path[PATHLEN];
+    const char *pager;
+    FILE *f;
+    int pid;
+
+    if (!prof.cells && !sp->profile) {
+        error("No profile: use `set profile` and recalc");
+        string_free(fname);
+        return;
+    }
+    if (n <= 0)
+        n = PROF_TOP;
+    if (fname) {
+        pstrcpy(path, sizeof path, s2c(fname));
+        string_free(fname);
+    } else {
+        if (!(pager = getenv("PAGER")))
+            pager = DFLT_PAGER;
+        snprintf(path, sizeof path, "| %s", pager);
+    }
+    f = openfile(path, sizeof path, &pid, NULL);
+    if (!f) {
+        error("Cannot open %s", path);
+        return;
+    }
+    profile_list(sp, f, n);
+    closefile(f, pid, 0);
+}
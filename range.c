@@ -78,8 +78,9 @@ void nrange_add(sheet_t *sp, SCXMEM string_t *name, rangeref_t rr, int is_range)
             /* empty cell to the left of the defined cell:
                set the cell label to the name.
              */
-            string_set(&cp->label, name);
+            cp->label = string_dup(name);
             cp->type = SC_STRING;
+            depgraph_dirty(sp, rr.left.row, rr.left.col - 1);
             // XXX: set IS_CHANGED?
             sp->modflg++;   // XXX: redundant
             FullUpdate++;   // XXX: redundant?
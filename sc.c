@@ -165,6 +165,7 @@ int main(int argc, char **argv) {
     }
 
     delbuf_init();
+    aggregate_init();
     sheet_init(sp);
 
     if (!isatty(STDOUT_FILENO) || popt || qopt == 1) usecurses = FALSE;
@@ -288,6 +289,9 @@ int main(int argc, char **argv) {
 #endif
     if (!qopt)
         vi_interaction(sp);
+#ifndef NOEXTFUNCS
+    ext_clean();
+#endif
     stopdisp();
     write_hist(string_dup(histfile));
 
@@ -295,8 +299,9 @@ int main(int argc, char **argv) {
         /* free all memory and check for remaining blocks */
         erasedb(sp);
         go_free(sp);
-        delbuf_clean();
+        delbuf_clean(sp);
         free_enode_list();
+        profile_clean();
         free_styles();
         free_hist();
         string_set(&histfile, NULL);
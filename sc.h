@@ -119,6 +119,7 @@ struct scvalue {
         int error;
     } u;
     int type;
+    int borrowed;   /* u.str is not owned by the value (SC_STRING only) */
 };
 
 typedef struct eval_context eval_ctx_t;
@@ -126,31 +127,42 @@ struct eval_context {
     struct sheet *sp;
     int gmyrow, gmycol;         /* for @myrow, @mycol functions */
     int rowoffset, coloffset;   /* row & col offsets for range functions */
+    int numiter;                /* for @numiter */
+    int threaded;               /* evaluated concurrently with other cells */
 };
 
-/* info for each cell, only alloc'd when something is stored in a cell */
+/* info for each cell, only alloc'd when something is stored in a cell.
+   The record is kept small for range scans: the numeric value, the
+   string value and the free list link share the same storage, the
+   cell format is kept in a side table (see ent_format()).
+ */
 struct ent {
-    // XXX: should use union
-    double v;                   /* v && label are set in EvalAll() */
-    SCXMEM string_t *label;     /* cell string value */
+    union {
+        double v;                   /* numeric or boolean value */
+        SCXMEM string_t *label;     /* string value if type is SC_STRING */
+        struct ent *next;           /* next free ent */
+    };
     SCXMEM enode_t *expr;       /* cell formula */
-    SCXMEM string_t *format;    /* printf format for this cell */
     unsigned char cellerror;    /* error in a cell? (should pack with flags) */
     unsigned char type;         /* SC_xxx */
     short flags;
-    struct ent *next;           /* next deleted ent (pulled, deleted cells) */
 };
 
 /* expression node is the basic block of formulae */
 struct enode {
     unsigned short op;
-    unsigned short type;
+    unsigned char type;
 #define OP_TYPE_FUNC    0
 #define OP_TYPE_VAR     1
 #define OP_TYPE_RANGE   2
 #define OP_TYPE_DOUBLE  3
 #define OP_TYPE_STRING  4
 #define OP_TYPE_ERROR   5
+    unsigned char flags;
+#define ENODE_PACKED    1   /* node is stored inside a packed block */
+#define ENODE_BLOCK     2   /* node is the head of a packed block */
+#define ENODE_CODE      4   /* packed block holds bytecode (interp.c) */
+#define ENODE_NUMERIC   8   /* bytecode only does arithmetic on numbers */
     int nargs;
     union {
         int error;                  /* error number */
@@ -269,6 +281,7 @@ extern struct opdef const opdefs[];
 #define ALIGN_CENTER    0200
 #define ALIGN_RIGHT     0300
 #define ALIGN_CLIP      0400  /* clip contents if longer than colwidth instead of displaying '*' */
+#define HAS_FORMAT     01000  /* cell has an entry in the format side table */
 
 /* error values */
 #define ERROR_NULL  1  // #NULL!  Intersection of ranges produced zero cells.
@@ -381,13 +394,28 @@ struct menu_item {
 
 #define MARK_COUNT  37
 
-/* The table data is organized as:
-   `tbl`: a pointer to an array of `maxrows` pointers to rows
-   each row pointer points to an array of `maxcols` pointers to cells
-   these cell pointers can be NULL or point to an allocated `ent` structure
-   This design is suboptimal in terms of memory space and implies much
-   dreaded three star programming.
+/* The table data is organized as a sparse array of tiles:
+   `tbl`: a pointer to an array of `maxrows / TILE_ROWS` band pointers
+   each band holds TILE_NCOLS pointers to tiles of TILE_ROWS x TILE_COLS
+   cell pointers, stored in column major order for fast range scans.
+   Bands and tiles are only allocated when a cell is stored in them, so
+   empty regions of the sheet only use a NULL pointer per band.
+   These cell pointers can be NULL or point to an allocated `ent` structure
  */
+#define TILE_ROWS_SHIFT  6
+#define TILE_COLS_SHIFT  4
+#define TILE_ROWS   (1 << TILE_ROWS_SHIFT)   /* 64 rows per tile */
+#define TILE_COLS   (1 << TILE_COLS_SHIFT)   /* 16 columns per tile */
+#define TILE_NCOLS  ((ABSMAXCOLS + TILE_COLS - 1) / TILE_COLS)
+
+typedef struct celltile {
+    struct ent *cp[TILE_COLS][TILE_ROWS];
+} celltile_t;
+
+typedef struct cellband {
+    SCXMEM celltile_t *tiles[TILE_NCOLS];
+} cellband_t;
+
 typedef struct rowfmt {
     unsigned char hidden;
 } rowfmt_t;
@@ -399,13 +427,164 @@ typedef struct colfmt {
     unsigned char realfmt;
 } colfmt_t;
 
-typedef struct rowptr {
-    short mincol, maxcol;
-    SCXMEM struct ent **cp;
-} rowptr_t;
+/* cell structures are allocated in slabs from a per sheet arena,
+   erasedb() releases them all at once */
+#define ENT_SLAB_SIZE  1024
+
+typedef struct entslab {
+    SCXMEM struct entslab *next;
+    struct ent ents[ENT_SLAB_SIZE];
+} entslab_t;
+
+typedef struct entarena {
+    SCXMEM entslab_t *slabs;
+    struct ent *free_ents;  /* list of freed cells, uses .next */
+    int avail;              /* number of unused cells in the first slab */
+} entarena_t;
+
+/* running totals of a mirrored column: entry r covers the rows 0 to
+   r-1.  The sums of numbers are kept as unevaluated pairs hi + lo so
+   the difference of two entries is accurate.
+ */
+typedef struct colprefix {
+    double sum, sumlo;          /* sum of numbers */
+    double sum2, sum2lo;        /* sum of squares of numbers */
+    double bsum, bsum2;         /* sum and sum of squares of booleans */
+    int count;                  /* number of numbers */
+    int nbool;                  /* number of booleans */
+    int nother;                 /* number of strings and errors */
+} colprefix_t;
+
+/* dense mirror of the cell values of a column for fast range scans.
+   Built on demand, invalidated by the cell write paths and updated in
+   place by the evaluator. Rows at and beyond `nrows` are empty.
+   When only a few cells change, the mirror is repaired by reloading
+   their rows instead of rebuilt.
+ */
+#define COLMIRROR_DIRTY  16     /* maximum number of rows to repair */
+
+typedef struct colmirror {
+    int valid;                  /* mirror is in sync with the cells */
+    unsigned int version;       /* incremented when a cell of the column changes */
+    int ndirty;                 /* number of rows to repair, -1 to rebuild */
+    int dirty[COLMIRROR_DIRTY]; /* rows changed since the mirror was valid */
+    int nrows;                  /* number of rows mirrored */
+    int size;                   /* number of rows allocated */
+    SCXMEM double *v;           /* value, error number or 0 */
+    SCXMEM unsigned char *type; /* SC_xxx cell type */
+    int pvalid;                 /* prefix[0] to prefix[pvalid] are valid */
+    int psize;                  /* number of prefix entries allocated */
+    int pbatch;                 /* entries usable by the recalc threads */
+    SCXMEM colprefix_t *prefix; /* running totals, see colmirror_prefix() */
+} colmirror_t;
+
+/* ranges shorter than this are scanned with getcell() */
+#define COLMIRROR_MIN_ROWS  32
+
+/* hash index of a column range for exact lookups, see eval_lookup() */
+typedef struct lookup_index {
+    struct lookup_index *next;
+    int col, row1, row2;        /* indexed range */
+    unsigned int version;       /* version of the column mirror when built */
+    int batch;                  /* valid for the current recalc thread batch */
+    int mask;                   /* number of slots - 1 */
+    SCXMEM int *slots;          /* offset + 1 of the last cell with a value */
+} lookup_index_t;
+
+/* cells of a range matching a criterion, see eval_aggregateif() */
+typedef struct critmap {
+    struct critmap *next;
+    rangeref_t rr;              /* normalized criteria range */
+    scvalue_t key;              /* criterion value, the string is shared */
+    SCXMEM unsigned int *versions;  /* versions of the column mirrors when built */
+    int batch;                  /* valid for the current recalc thread batch */
+    SCXMEM unsigned int *bits;  /* one bit per cell in row major order */
+} critmap_t;
+
+/* formula dependency graph, see graph.c */
+typedef struct depref {
+    rangeref_t rr;          /* normalized cell or range reference */
+    int node;               /* formula node holding the reference */
+} depref_t;
+
+#define RTREE_FANOUT  16
+#define RTREE_LEVELS  10
+
+typedef struct depnode {
+    struct ent *p;
+    int row, col;
+    int refs, nrefs;        /* static references in depgraph.refs */
+    int deps, ndeps;        /* dependent nodes in depgraph.deps */
+    int flags;
+#define DEP_DYNAMIC  1      /* references are only known at run time */
+#define DEP_ORDERED  2      /* node is in the topological order */
+#define DEP_VOLATILE 4      /* evaluated on every recalc */
+#define DEP_DIRTY    8      /* a precedent has changed */
+#define DEP_SERIAL   16     /* must be evaluated by the main thread */
+#define DEP_FPE      32     /* floating point exception in a recalc thread */
+#define DEP_CYCLE    64     /* node is on a circular reference */
+#define DEP_TOTALS   128    /* range sums or counts, see colmirror_prefix() */
+#define DEP_LOOKUP   256    /* exact lookups, see lookup_index_get() */
+#define DEP_CRITERIA 512    /* conditional aggregates and database functions */
+#define DEP_QUEUED   1024   /* queued for evaluation, see EvalSparse() */
+} depnode_t;
+
+typedef struct depgraph {
+    int nnodes, nodesize;
+    SCXMEM depnode_t *nodes;    /* formula cells in calc_order order */
+    int nrefs, refsize;
+    SCXMEM depref_t *refs;      /* references of all nodes */
+    SCXMEM depref_t *rtleaf;    /* reference index: sorted references */
+    SCXMEM rangeref_t *rtbox;   /* reference index: bounding boxes */
+    int rtlevels;
+    int rtlevel[RTREE_LEVELS];  /* offset of each level in rtbox */
+    int rtcount[RTREE_LEVELS];  /* number of entries of each level */
+    int nedges;
+    SCXMEM int *deps;           /* dependent lists of all nodes */
+    int hashsize;
+    SCXMEM int *hash;           /* node index by cell position */
+    int norder;
+    SCXMEM int *order;          /* acyclic nodes in evaluation order */
+    SCXMEM int *pos;            /* position of each node in order or -1 */
+    int nlevels;
+    SCXMEM int *levels;         /* offset of each level in order */
+    int nrest;
+    SCXMEM int *rest;           /* nodes that cannot be ordered */
+    int nblocks;
+    SCXMEM int *blocks;         /* offset of each component in rest */
+    int ndynamic;               /* nodes iterated together at the end of rest */
+    int nvolatile;
+    SCXMEM int *volatiles;      /* nodes evaluated on every recalc */
+    int ndirty, dirtysize;
+    SCXMEM int *dirty;          /* nodes marked dirty since the last recalc */
+    int full;                   /* all nodes must be evaluated */
+    int pending;                /* recalc interrupted by EvalSlice() */
+    int next;                   /* position in order to continue from */
+    int nextblock;              /* component of rest to continue from */
+} depgraph_t;
+
+/* engine statistics, listed by the stats command */
+typedef struct scstats {
+    double recalc_time;         /* duration of the last recalc */
+    long recalc_formulas;       /* formulas evaluated by the last recalc */
+    int recalc_iterations;      /* iterations used by the last recalc */
+    double load_time;           /* duration of the last file load */
+    double save_time;           /* duration of the last file save */
+    double time;                /* totals of the recalc in progress */
+    long formulas;
+    int iterations;
+} scstats_t;
 
 typedef struct sheet {
-    SCXMEM rowptr_t *tbl;
+    SCXMEM cellband_t **tbl;
+    entarena_t cells;       /* allocator for the cell structures */
+    SCXMEM colmirror_t **colmirror;  /* ABSMAXCOLS column mirrors */
+    SCXMEM lookup_index_t *lookup_cache;  /* most recently used first */
+    SCXMEM critmap_t *crit_cache;   /* most recently used first */
+    SCXMEM depgraph_t *graph;   /* NULL until needed for recalc */
+    int nedits, editsize;
+    SCXMEM cellref_t *edits;    /* cells to recalc when the graph is rebuilt */
+    scstats_t stats;
     int maxrow, maxcol;
     int maxrows, maxcols;   /* # cells currently allocated */
     int currow, curcol;     /* current cell */
@@ -440,11 +619,16 @@ typedef struct sheet {
     int optimize;     /* Causes numeric expressions to be optimized */
     int rndtoeven;
     int propagation;   /* max number of times to try calculation */
+    int threads;       /* number of threads for recalc */
     int calc_order;
     int protect;
     int numeric;
     double prescale;   /* Prescale for constants in let() */
     int extfunc;       /* Enable/disable external functions */
+    int extjobs;       /* max number of external commands run at once */
+    int exttimeout;    /* seconds before an external command is killed */
+    int extttl;        /* seconds an external function result is reused */
+    int profile;       /* record formula and function evaluation times */
     int showtop;
     int tbl_style;     /* headers for T command output */
     int craction;      /* 1 for down, 2 for right */
@@ -463,6 +647,16 @@ static inline int row_hidden(sheet_t *sp, int row) { return row < sp->maxrows &&
 static inline int col_hidden(sheet_t *sp, int col) { return col < sp->maxcols && sp->colfmt[col].hidden; }
 static inline int col_fwidth(sheet_t *sp, int col) { return col < sp->maxcols ? sp->colfmt[col].fwidth : DEFWIDTH; }
 
+/* return the address of the cell pointer for row,col or NULL if the
+   band or tile is not allocated. row and col must be inside the allocated table */
+static inline struct ent **tbl_slot(sheet_t *sp, int row, int col) {
+    cellband_t *bp = sp->tbl[row >> TILE_ROWS_SHIFT];
+    celltile_t *tp;
+    if (bp && (tp = bp->tiles[col >> TILE_COLS_SHIFT]) != NULL)
+        return &tp->cp[col & (TILE_COLS - 1)][row & (TILE_ROWS - 1)];
+    return NULL;
+}
+
 typedef struct adjust_context {
     sheet_t *sp;
     rangeref_t clamp_rr;
@@ -611,7 +805,113 @@ extern int load_scrc(sheet_t *sp);
 extern struct ent *lookat(sheet_t *sp, int row, int col);  /* extends the sheet, allocates the cell */
 extern struct ent *getcell(sheet_t *sp, int row, int col); /* does not allocate the cell */
 extern int valid_cell(sheet_t *sp, int row, int col); /* check if the cell at row,col is not empty */
+extern string_t *ent_format(struct ent *p);
+extern void ent_set_format(struct ent *p, SCXMEM string_t *format);
+
+/* release the value of a cell, leave it empty */
+static inline void ent_clear_value(struct ent *p) {
+    if (p->type == SC_STRING)
+        string_free(p->label);
+    p->v = 0.0;
+    p->type = SC_EMPTY;
+    p->cellerror = 0;
+}
 extern int checkbounds(sheet_t *sp, int row, int col);
+extern struct ent **tbl_slot_alloc(sheet_t *sp, int row, int col); /* allocates the tile */
+extern void tbl_move_area(sheet_t *sp, rangeref_t rr, int dr, int dc);
+extern void tbl_free(sheet_t *sp);
+extern colmirror_t *colmirror_get(sheet_t *sp, int col);
+extern int colmirror_prefix(colmirror_t *mp, int n);
+
+/* aggregate kernels over mirrored values (aggregate.c) */
+typedef struct aggrvec {
+    int count;
+    double sum, sum2, min, max;
+} aggrvec_t;
+
+extern void aggregate_init(void);
+extern void aggrvec_init(aggrvec_t *ap);
+extern depgraph_t *depgraph_get(sheet_t *sp);
+extern int depgraph_find(depgraph_t *g, int row, int col);
+extern void depgraph_invalidate(sheet_t *sp);
+extern void depgraph_edit(sheet_t *sp, int row, int col);
+extern void depgraph_dirty(sheet_t *sp, int row, int col);
+extern void depgraph_dirty_all(sheet_t *sp);
+extern int depgraph_pending(sheet_t *sp);
+extern int depgraph_stale(sheet_t *sp, int row, int col);
+extern void aggregate_values(aggrvec_t *ap, const double *v, const unsigned char *type,
+                             int n, int allvalues);
+extern void colmirror_free(sheet_t *sp);
+
+/* the mirrored value of a cell: numeric value, error number or 0 */
+static inline double colmirror_value(struct ent *p) {
+    return (p->type == SC_NUMBER || p->type == SC_BOOLEAN) ? p->v :
+        (p->type == SC_ERROR) ? p->cellerror : 0.0;
+}
+
+static inline void colmirror_invalidate(sheet_t *sp, int col) {
+    if (sp->colmirror && sp->colmirror[col]) {
+        sp->colmirror[col]->version++;
+        sp->colmirror[col]->valid = 0;
+        sp->colmirror[col]->ndirty = -1;
+    }
+}
+
+/* the cell at row,col is about to change: remember its row so the
+   mirror can be repaired instead of rebuilt */
+static inline void colmirror_touch(sheet_t *sp, int row, int col) {
+    colmirror_t *mp;
+    if (sp->colmirror && (mp = sp->colmirror[col])) {
+        if (mp->ndirty >= 0 && mp->ndirty < COLMIRROR_DIRTY && row < mp->nrows) {
+            mp->version++;
+            mp->dirty[mp->ndirty++] = row;
+            mp->valid = 0;
+        } else {
+            colmirror_invalidate(sp, col);
+        }
+    }
+}
+
+/* the running totals past row are stale, prefix[row] is still valid.
+   Recalc threads may change different rows of the column concurrently.
+ */
+static inline void colmirror_prefix_cut(colmirror_t *mp, int row) {
+#ifdef SC_THREADS
+    int pvalid = __atomic_load_n(&mp->pvalid, __ATOMIC_RELAXED);
+    while (pvalid > row && !__atomic_compare_exchange_n(&mp->pvalid, &pvalid, row, 1,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        continue;
+#else
+    if (mp->pvalid > row)
+        mp->pvalid = row;
+#endif
+}
+
+/* update the mirror after the value of cell p at row,col changed */
+static inline void colmirror_update(sheet_t *sp, int row, int col, struct ent *p) {
+    colmirror_t *mp;
+    int i;
+    if (!sp->colmirror || !(mp = sp->colmirror[col]))
+        return;
+#ifdef SC_THREADS
+    /* recalc threads may change different rows of the column */
+    __atomic_fetch_add(&mp->version, 1, __ATOMIC_RELAXED);
+#else
+    mp->version++;
+#endif
+    if (mp->valid && row < mp->nrows) {
+        mp->type[row] = p->type;
+        mp->v[row] = colmirror_value(p);
+        colmirror_prefix_cut(mp, row);
+        return;
+    }
+    for (i = 0; i < mp->ndirty; i++) {
+        if (mp->dirty[i] == row)
+            return;     /* the row will be reloaded by the repair */
+    }
+    mp->valid = 0;
+    mp->ndirty = -1;
+}
 
 /*---------------- expressions ----------------*/
 
@@ -641,11 +941,16 @@ extern enode_t *copye(sheet_t *sp, enode_t *e, int Rdelta, int Cdelta,
 extern int decompile(sheet_t *sp, char *dest, size_t size, enode_t *e, int dr, int dc, int dcp_flags);
 extern int decompile_expr(sheet_t *sp, buf_t buf, enode_t *e, int dr, int dc, int flags);
 extern void efree(SCXMEM enode_t *e);
+extern SCXMEM enode_t *enode_pack(SCXMEM enode_t *e);
+extern void enode_compile(enode_t *e);
 extern int buf_putvalue(buf_t buf, scvalue_t a);
 extern void free_enode_list(void);
 
 extern void EvalAll(sheet_t *sp);
+extern int EvalSlice(sheet_t *sp, int ms);
 extern scvalue_t eval_at(sheet_t *sp, enode_t *e, int row, int col);
+extern void lookup_cache_free(sheet_t *sp);
+extern void crit_cache_free(sheet_t *sp);
 extern SCXMEM string_t *seval_at(sheet_t *sp, enode_t *se, int row, int col, int *errp);
 extern double neval_at(sheet_t *sp, enode_t *e, int row, int col, int *errp);
 
@@ -703,13 +1008,32 @@ extern void yank_rows(sheet_t *sp, int r1, int r2);
 extern void yank_range(sheet_t *sp, rangeref_t rr);
 
 extern void delbuf_init(void);
-extern void delbuf_clean(void);
+extern void delbuf_clean(sheet_t *sp);
 extern void delbuf_list(sheet_t *sp, FILE *f);
 
 /*---------------- spreadsheet options ----------------*/
 
 extern void set_autocalc(sheet_t *sp, int i);
 extern void set_iterations(sheet_t *sp, int i);
+extern void set_threads(sheet_t *sp, int n);
+extern void set_extjobs(sheet_t *sp, int n);
+extern void set_exttimeout(sheet_t *sp, int n);
+extern void set_extttl(sheet_t *sp, int n);
+
+/* external function commands (extfunc.c) */
+extern SCXMEM string_t *ext_result(sheet_t *sp, const char *command, int *errp);
+extern void ext_expire(void);
+extern int ext_pending(void);
+extern int ext_poll(sheet_t *sp, int ms);
+extern int ext_wait(sheet_t *sp);
+extern void ext_clean(void);
+
+/* recalc profiler (profile.c) */
+extern void set_profile(sheet_t *sp, int on);
+extern void profile_cell(int row, int col, double t);
+extern void profile_op(enode_t *e, double t, double self);
+extern void profile_clean(void);
+extern void cmd_profile(sheet_t *sp, int n, SCXMEM string_t *fname);
 extern void set_calcorder(sheet_t *sp, int i);
 extern void set_mdir(sheet_t *sp, SCXMEM string_t *str);
 extern void set_autorun(sheet_t *sp, SCXMEM string_t *str);
@@ -897,6 +1221,8 @@ extern void cmd_seval(sheet_t *sp, SCXMEM enode_t *e, int row, int col, int fd);
 extern void cmd_query(sheet_t *sp, SCXMEM string_t *s, SCXMEM string_t *data, int fd);
 extern void cmd_getkey(sheet_t *sp, int fd);
 extern void cmd_status(sheet_t *sp, int fd);
+extern void cmd_cycles(sheet_t *sp, int fd);
+extern void cmd_stats(sheet_t *sp, int fd);
 extern void cmd_whereami(sheet_t *sp, int fd);
 
 /*---------------- display ----------------*/
@@ -917,6 +1243,7 @@ extern void resetkbd(void);
 
 extern int nmgetch(int clearline);
 extern int nmgetch_savepos(int clearline);
+extern int screen_wait_key(int ms);
 extern int nmungetch(int c);
 
 extern void startdisp(void);
@@ -727,6 +727,7 @@ void update(sheet_t *sp, int anychanged) {          /* did any cell really chang
         {
             int c = sp->rescol;
             int do_stand = 0;
+            int stale = 0;
             int fieldlen;
             int nextcol;
             int len;
@@ -808,6 +809,11 @@ void update(sheet_t *sp, int anychanged) {          /* did any cell really chang
                     select_style(cr->color, 0);
 
                 if (p && ((p->flags & IS_CHANGED) || FullUpdate || do_stand)) {
+                    /* dim the formulas not yet evaluated by a pending recalc */
+                    if (p->expr && depgraph_stale(sp, row, col)) {
+                        attron(A_DIM);
+                        stale = 1;
+                    }
                     if (do_stand) {
                         p->flags |= IS_CHANGED;
                     } else {
@@ -846,8 +852,8 @@ void update(sheet_t *sp, int anychanged) {          /* did any cell really chang
                             }
                             /* convert cell contents, do not test width, should not align */
                             *field = '\0';
-                            if (p->format) {
-                                len = format(field, sizeof field, s2c(p->format), sp->colfmt[col].precision, p->v, &align);
+                            if (p->flags & HAS_FORMAT) {
+                                len = format(field, sizeof field, s2c(ent_format(p)), sp->colfmt[col].precision, p->v, &align);
                             } else {
                                 len = engformat(field, sizeof field, sp->colfmt[col].realfmt, sp->colfmt[col].precision, p->v, &align);
                             }
@@ -949,6 +955,10 @@ void update(sheet_t *sp, int anychanged) {          /* did any cell really chang
                     select_style(cr->color, 0);
                     printw("%*s", fieldlen, "");
                 }
+                if (stale) {
+                    attroff(A_DIM);
+                    stale = 0;
+                }
                 select_style(STYLE_CELL, 0);
                 if (do_stand) {
                     //standend();
@@ -1006,8 +1016,8 @@ void update(sheet_t *sp, int anychanged) {          /* did any cell really chang
             p = getcell(sp, sp->currow, sp->curcol);
 
             /* show the current cell format */
-            if (p && p->format) {
-                printw("(%s) ", s2c(p->format));
+            if (p && (p->flags & HAS_FORMAT)) {
+                printw("(%s) ", s2c(ent_format(p)));
             } else {
                 printw("(%d %d %d) ", col_fwidth(sp, sp->curcol),
                        sp->colfmt[sp->curcol].precision,
@@ -1870,6 +1880,26 @@ int nmgetch_savepos(int clearline) {
     return c;
 }
 
+/* wait up to `ms` milliseconds for a key, return 1 if one is available,
+   0 if not and -1 if the keyboard cannot be polled: only curses can poll
+   it, other builds wait in nmgetch() */
+int screen_wait_key(int ms) {
+#if !defined(SIMPLE) && !defined(BSD42) && !defined(SYSIII) && !defined(BSD43)
+    int c;
+
+    if (usecurses) {
+        timeout(ms);
+        c = getch();
+        timeout(-1);
+        if (c == ERR)
+            return 0;
+        ungetch(c);
+        return 1;
+    }
+#endif
+    return -1;
+}
+
 int nmungetch(int c) {
     return ungetch(c);
 }
@@ -3,18 +3,27 @@
  *                 malloc wrappers
  *                 string functions
  *                 buffered strings
+ *                 time measurement
  *
  *              updated by Charlie Gordon: June, 2021
  *
  *              $Revision: 9.1 $
  */
 
+#include <time.h>
 #include "sc.h"
 
+#ifdef SC_THREADS
+#include <pthread.h>
+#endif
+
 size_t scxmem_count;        /* number of active memory blocks */
 size_t scxmem_requested;    /* total amount of memory requested */
 size_t scxmem_allocated;    /* total amount of memory allocated */
 size_t scxmem_overhead;     /* amount of overhead from scxmem features */
+size_t scxmem_strings;      /* amount of memory requested for strings */
+size_t scxmem_enodes;       /* amount of memory requested for enodes */
+int scxmem_shared;          /* set during parallel recalc */
 
 #define SCXMALLOC_USE_MAGIC  1
 #define SCXMALLOC_TRACK_BLOCKS  1
@@ -34,7 +43,18 @@ static struct dlink {
     0, &mem_head, &mem_head
 };
 
+/* the block list is locked while recalc threads are running */
+#ifdef SC_THREADS
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+# define mem_lock()    (void)(scxmem_shared && pthread_mutex_lock(&mem_mutex))
+# define mem_unlock()  (void)(scxmem_shared && pthread_mutex_unlock(&mem_mutex))
+#else
+# define mem_lock()    (void)0
+# define mem_unlock()  (void)0
+#endif
+
 static void link_block(struct dlink *p, size_t size) {
+    mem_lock();
     scxmem_count++;
     scxmem_requested += size;
     scxmem_allocated += (size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
@@ -43,15 +63,18 @@ static void link_block(struct dlink *p, size_t size) {
     p->prev = mem_head.prev;
     p->next = &mem_head;
     p->prev->next = p->next->prev = p;
+    mem_unlock();
 }
 
 static void unlink_block(struct dlink *p) {
+    mem_lock();
     scxmem_count--;
     scxmem_requested -= p->size;
     scxmem_allocated -= (p->size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
     scxmem_overhead -= sizeof(struct dlink);
     p->prev->next = p->next;
     p->next->prev = p->prev;
+    mem_unlock();
 }
 #else
 # define link_block(p,s)  (void)(p,s)
@@ -145,6 +168,15 @@ void scxfree(SCXMEM void *p) {
     }
 }
 
+/* size requested for a block, 0 if it is not known */
+size_t scxmem_size(SCXMEM void *p) {
+#ifdef SCXMALLOC_TRACK_BLOCKS
+    if (p != NULL)
+        return ((struct dlink *)(void *)((unsigned char *)p - MAGIC_SIZE))->size;
+#endif
+    return 0;
+}
+
 void scxmemdump(void) {
 #ifdef SCXMALLOC_TRACK_BLOCKS
     struct dlink *b = mem_head.next;
@@ -196,6 +228,14 @@ void scxmemdump(void) {
 
 static SCXMEM string_t *empty_string;
 
+/* strings are allocated and freed by the recalc threads too */
+#ifdef SC_THREADS
+#define string_account(n)  __atomic_add_fetch(&scxmem_strings, (n), __ATOMIC_RELAXED)
+#else
+#define string_account(n)  (scxmem_strings += (n))
+#endif
+#define string_size(str)  (offsetof(string_t, s) + (size_t)(str)->len + 1)
+
 void string_init(void) {
     empty_string = string_new_len("", 0, STRING_ASCII);
 }
@@ -214,6 +254,7 @@ SCXMEM string_t *string_new(const char *s) {
     if (str) {
         str->refcount = 1;
         str->len = len;
+        string_account(string_size(str));
         str->encoding = 0;
         str->flags = 0;
         memcpy(str->s, s, len + 1);
@@ -226,6 +267,7 @@ SCXMEM string_t *string_new_len(const char *s, size_t len, int encoding) {
     if (str) {
         str->refcount = 1;
         str->len = len;
+        string_account(string_size(str));
         str->encoding = encoding;
         str->flags = 0;
         if (s) memcpy(str->s, s, len);
@@ -234,6 +276,12 @@ SCXMEM string_t *string_new_len(const char *s, size_t len, int encoding) {
     return str;
 }
 
+/* free a string when its last reference is released */
+void string_delete(SCXMEM string_t *str) {
+    string_account(-string_size(str));
+    scxfree(str);
+}
+
 SCXMEM string_t *string_clone(SCXMEM string_t *str) {
     if (str && str->refcount > 1 && slen(str) > 0) {
         SCXMEM string_t *s2 = string_new_len(s2c(str), slen(str), str->encoding);
@@ -780,3 +828,12 @@ int buf_quotestr(buf_t buf, int c1, const char *s, int c2) {
         res += buf_putc(buf, c2);
     return res;
 }
+
+/*---------------- time measurement ----------------*/
+
+/* monotonic time in seconds for timeouts and time slices */
+double sc_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -33,16 +33,25 @@
 
 #define countof(a)  (sizeof(a) / sizeof(*(a)))
 
+/* recalc threads need pthreads and the compiler atomic builtins */
+#if defined(HAVE_PTHREAD) && (defined(__GNUC__) || defined(__clang__))
+#define SC_THREADS  1
+#endif
+
 /*---------------- Memory allocation ----------------*/
 
 #define SCXMEM  /* flag allocated pointers with this */
 
 extern size_t scxmem_count, scxmem_requested, scxmem_allocated, scxmem_overhead;
+extern size_t scxmem_strings;   /* memory requested for strings */
+extern size_t scxmem_enodes;    /* memory requested for expression nodes */
+extern int scxmem_shared;   /* memory is allocated by several threads */
 
 extern SCXMEM void *scxmalloc(size_t n);
 extern SCXMEM void *scxrealloc(SCXMEM void *ptr, size_t n);
 extern SCXMEM char *scxdup(const char *s);
 extern void scxfree(SCXMEM void *p);
+extern size_t scxmem_size(SCXMEM void *p);
 extern void scxmemdump(void);
 
 /*---------------- string utilities ----------------*/
@@ -103,6 +112,7 @@ void string_exit(void);
 SCXMEM string_t *string_new(const char *s);
 SCXMEM string_t *string_new_len(const char *s, size_t len, int encoding);
 SCXMEM string_t *string_clone(SCXMEM string_t *str);
+void string_delete(SCXMEM string_t *str);
 SCXMEM string_t *string_empty(void);
 int string_get_encoding(string_t *str);
 
@@ -114,6 +124,20 @@ static inline int string_is_utf8(string_t *str) {
     return (str->encoding & STRING_UTF8) || (string_get_encoding(str) & STRING_UTF8);
 }
 
+/* strings are shared between the recalc threads: update the reference
+   counts atomically when threads are available.
+ */
+#ifdef SC_THREADS
+static inline SCXMEM string_t *string_dup(string_t *str) {
+    if (str) __atomic_add_fetch(&str->refcount, 1, __ATOMIC_RELAXED);
+    return str;
+}
+
+static inline void string_free(SCXMEM string_t *str) {
+    if (str && !__atomic_sub_fetch(&str->refcount, 1, __ATOMIC_ACQ_REL))
+        string_delete(str);
+}
+#else
 static inline SCXMEM string_t *string_dup(string_t *str) {
     if (str) str->refcount++;
     return str;
@@ -121,8 +145,9 @@ static inline SCXMEM string_t *string_dup(string_t *str) {
 
 static inline void string_free(SCXMEM string_t *str) {
     if (str && !--str->refcount)
-        scxfree(str);
+        string_delete(str);
 }
+#endif
 
 static inline const char *s2c(const string_t *str) { return str->s; }
 static inline const char *s2str(const string_t *str) { return str ? str->s : ""; }
@@ -224,3 +249,6 @@ int buf_extend(buf_t buf, size_t size, size_t blocksize);
 
 int buf_quotechar(buf_t buf, int c1, int c, int c2);
 int buf_quotestr(buf_t buf, int c1, const char *s, int c2);
+
+/* monotonic time in seconds */
+extern double sc_clock(void);
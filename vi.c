@@ -102,6 +102,7 @@ static int search_dir;      /* Search direction:  forward = 0; back = 1 */
 #define NAVIGATE_MODE   4   /* Navigate the spreadsheet while editing a line */
 
 #define DOTLEN          200
+#define RECALC_SLICE    50  /* milliseconds of recalc between keyboard checks */
 
 static int mode = INSERT_MODE;
 static int help_topic = HELP_INTRO;
@@ -156,6 +157,25 @@ static void init_line(void) {
     linelim = linelen = 0;
 }
 
+/* keys that only move the cursor or redraw the screen: an interrupted
+   recalc is continued after them, other commands may read the cell
+   values and complete it first.
+ */
+static int vi_navigation_key(int c) {
+    switch (c) {
+    case SC_KEY_UP:     case SC_KEY_DOWN:   case SC_KEY_LEFT:   case SC_KEY_RIGHT:
+    case SC_KEY_PPAGE:  case SC_KEY_NPAGE:  case SC_KEY_HOME:   case SC_KEY_RESIZE:
+    case SC_ALT('v'):
+    case ctl('b'):  case ctl('f'):  case ctl('n'):  case ctl('p'):
+    case ctl('e'):  case ctl('y'):  case ctl('l'):  case ctl('r'):
+    case 'h':  case 'j':  case 'k':  case 'l':  case ' ':
+    case 'H':  case 'J':  case 'K':  case 'L':
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
 void vi_interaction(sheet_t *sp) {
     int inloop = 1;
     int c, ch2;
@@ -164,6 +184,10 @@ void vi_interaction(sheet_t *sp) {
     int nedistate;
     int running;
     int anychanged = FALSE;
+    int shown;
+#ifndef NOEXTFUNCS
+    int arrived;
+#endif
     char *ext;
     struct ent *p;
     buf_t buf;
@@ -179,8 +203,22 @@ void vi_interaction(sheet_t *sp) {
             sp = sht;
             nedistate = -1;
             narg = 1;
-            if (edistate < 0 && linelim < 0 && sp->autocalc && (changed || FullUpdate)) {
-                EvalAll(sp);
+            if (edistate < 0 && linelim < 0 && sp->autocalc
+            &&  (changed || FullUpdate || depgraph_pending(sp))) {
+                /* recalc in time slices until a key is pressed.  If it
+                   takes more than one slice, the screen is updated with
+                   the stale cells dimmed until the recalc completes */
+                for (shown = 0; !EvalSlice(sp, RECALC_SLICE); shown = 1) {
+                    if (!shown) {
+                        FullUpdate++;
+                        update(sp, TRUE);
+                        screen_refresh();
+                    }
+                    if (screen_wait_key(0) > 0)
+                        break;
+                }
+                if (shown)
+                    FullUpdate++;
                 if (changed)    /* if EvalAll changed or was before */
                     anychanged = TRUE;
                 changed = 0;
@@ -194,8 +232,22 @@ void vi_interaction(sheet_t *sp) {
             anychanged = FALSE;
 #ifndef SYSV3   /* HP/Ux 3.1 this may not be wanted */
             screen_refresh(); /* 5.3 does a refresh in getch */
+#endif
+#ifndef NOEXTFUNCS
+            /* collect the external function results while waiting for a key */
+            arrived = 0;
+            while (!arrived && ext_pending() && screen_wait_key(0) == 0)
+                arrived = ext_poll(sp, 50);
+            if (arrived) {
+                changed++;
+                continue;
+            }
 #endif
             c = nmgetch_savepos(1);
+            if (depgraph_pending(sp) && (linelim >= 0 || !vi_navigation_key(c))) {
+                EvalAll(sp);
+                FullUpdate++;
+            }
             seenerr = 0;
             showneed = 0;   /* reset after each update */
             showexpr = 0;
@@ -415,7 +467,7 @@ void vi_interaction(sheet_t *sp) {
                     switch (nmgetch(1)) {
                     case 'a': case 'A':
                     case 'm': case 'M':
-                        sp->autocalc ^= 1;
+                        set_autocalc(sp, !sp->autocalc);
                         error("Automatic recalculation %s.",
                               sp->autocalc ? "enabled" : "disabled");
                         break;
@@ -696,6 +748,7 @@ void vi_interaction(sheet_t *sp) {
                     break;      /* Be nice to vi users */
 
                 case '@':
+                    depgraph_dirty_all(sp);
                     EvalAll(sp);
                     changed = 0;    // XXX: questionable
                     anychanged = TRUE;
@@ -723,6 +776,8 @@ void vi_interaction(sheet_t *sp) {
                                 p->v += (double)uarg;
                             else
                                 p->v -= (double)uarg;
+                            colmirror_update(sp, sp->currow, sp->curcol, p);
+                            depgraph_dirty(sp, sp->currow, sp->curcol);
                             FullUpdate++;
                             sp->modflg++;
                             continue;
@@ -1101,10 +1156,10 @@ void vi_interaction(sheet_t *sp) {
                     break;
                 case 'F':
                     p = getcell(sp, sp->currow, sp->curcol);
-                    if (p && p->format) {
+                    if (p && (p->flags & HAS_FORMAT)) {
                         buf_init(buf, line, sizeof line);
                         buf_setf(buf, "fmt [format] %s \"", cell_addr(sp, cellref_current(sp)));
-                        buf_quotestr(buf, 0, s2c(p->format), 0);
+                        buf_quotestr(buf, 0, s2c(ent_format(p)), 0);
                         linelim = linelen = buf->len;
                         edit_mode();
                     } else {
@@ -1750,7 +1805,7 @@ static void write_line(sheet_t *sp, int c) {
                                 char temp[100];
 
                                 p = getcell(sp, sp->currow, sp->curcol);
-                                if (p && (p->flags == SC_NUMBER)) {
+                                if (p && p->type == SC_NUMBER) {
                                     snprintf(temp, sizeof temp, "%.*f",
                                              sp->colfmt[sp->curcol].precision, p->v);
                                     ins_string(sp, temp);
@@ -28,13 +28,26 @@
 static const char nolonger[] = "The table cannot be any longer";
 static const char nowider[] = "The table cannot be any wider";
 
+/* compute the new capacity for an array of `cur` elements that must hold
+   index `top`: grow geometrically so appending costs amortized O(1)
+ */
+static int grow_size(int cur, int top, int maxsize) {
+    int n = cur + cur / 2;
+    if (n <= top)
+        n = top + 1;
+    n = (n + GROWAMT - 1) / GROWAMT * GROWAMT;
+    return n > maxsize ? maxsize : n;
+}
+
 /*
  * grow the main && auxiliary tables (update maxrows/maxcols as needed)
  * toprow &&/|| topcol tell us a better guess of how big to become.
+ * Only the per row and per column arrays and the band directory are
+ * reallocated here, bands and tiles are allocated on first use.
  * we return TRUE if we could grow, FALSE if not....
  */
 static int growtbl(sheet_t *sp, int toprow, int topcol) {
-    int row, curcols, currows, newrows, newcols;
+    int curcols, currows, newrows, newcols;
 
     newrows = currows = sp->maxrows;
     newcols = curcols = sp->maxcols;
@@ -44,36 +57,29 @@ static int growtbl(sheet_t *sp, int toprow, int topcol) {
             error(nowider);
             return FALSE;
         }
-        newcols = (topcol / GROWAMT + 1) * GROWAMT;
-        if (newcols > ABSMAXCOLS)
-            newcols = ABSMAXCOLS;
+        newcols = grow_size(curcols, topcol, ABSMAXCOLS);
     }
     if (toprow >= currows) {
         if (toprow > ABSMAXROWS) {
             error(nolonger);
             return FALSE;
         }
-        newrows = (toprow / GROWAMT + 1) * GROWAMT;
-        if (newrows > ABSMAXROWS)
-            newrows = ABSMAXROWS;
+        newrows = grow_size(currows, toprow, ABSMAXROWS);
     }
     if (newcols > curcols) {
         colfmt_t def_colfmt = { FALSE, DEFWIDTH, DEFPREC, DEFREFMT };
         GROWALLOC(sp->colfmt, curcols, newcols, nowider, def_colfmt);
-        for (row = 0; row < currows; row++) {
-            GROWALLOC(sp->tbl[row].cp, curcols, newcols, nowider, NULL);
-            sp->tbl[row].maxcol = newcols - 1;
-        }
+        /* bands have room for all columns: nothing else to grow */
     }
 
     if (newrows > currows) {
         rowfmt_t def_rowfmt = { FALSE };
-        rowptr_t def_rowptr = { 0, -1, NULL };
+        /* allocate band pointers for whole tiles */
+        int curbands = (currows + TILE_ROWS - 1) >> TILE_ROWS_SHIFT;
+        int newbands = (newrows + TILE_ROWS - 1) >> TILE_ROWS_SHIFT;
         GROWALLOC(sp->rowfmt, currows, newrows, nolonger, def_rowfmt);
-        GROWALLOC(sp->tbl, currows, newrows, nolonger, def_rowptr);
-        for (row = currows; row < newrows; row++) {
-            GROWALLOC(sp->tbl[row].cp, 0, newcols, nolonger, NULL);
-            sp->tbl[row].maxcol = newcols - 1;
+        if (newbands > curbands) {
+            GROWALLOC(sp->tbl, curbands, newbands, nolonger, NULL);
         }
     }
     sp->maxrows = newrows;
@@ -101,3 +107,252 @@ int checkbounds(sheet_t *sp, int row, int col) {
     else
         return 0;
 }
+
+/* return the address of the cell pointer for row,col, allocating the
+   band and the tile if needed. row and col must be inside the allocated table */
+struct ent **tbl_slot_alloc(sheet_t *sp, int row, int col) {
+    cellband_t **bpp = &sp->tbl[row >> TILE_ROWS_SHIFT];
+    celltile_t **tpp;
+    if (!*bpp) {
+        cellband_t *bp = scxmalloc(sizeof(*bp));
+        if (!bp)
+            return NULL;
+        memset(bp, 0, sizeof(*bp));
+        *bpp = bp;
+    }
+    tpp = &(*bpp)->tiles[col >> TILE_COLS_SHIFT];
+    if (!*tpp) {
+        celltile_t *tp = scxmalloc(sizeof(*tp));
+        if (!tp)
+            return NULL;
+        memset(tp, 0, sizeof(*tp));
+        *tpp = tp;
+    }
+    return &(*tpp)->cp[col & (TILE_COLS - 1)][row & (TILE_ROWS - 1)];
+}
+
+/* move the cells in range rr by dr rows and dc columns.
+   The destination cells must be empty, source cells are left empty.
+   Cells are moved in an order compatible with overlapping ranges,
+   missing source bands and tiles are skipped.
+ */
+void tbl_move_area(sheet_t *sp, rangeref_t rr, int dr, int dc) {
+    int r, c, r1, r2, rstep, c1, c2, cstep;
+
+    if (dr > 0) {
+        r1 = rr.right.row; r2 = rr.left.row - 1; rstep = -1;
+    } else {
+        r1 = rr.left.row; r2 = rr.right.row + 1; rstep = 1;
+    }
+    if (dc > 0) {
+        c1 = rr.right.col; c2 = rr.left.col - 1; cstep = -1;
+    } else {
+        c1 = rr.left.col; c2 = rr.right.col + 1; cstep = 1;
+    }
+    for (c = rr.left.col; c <= rr.right.col; c++) {
+        colmirror_invalidate(sp, c);
+        colmirror_invalidate(sp, c + dc);
+    }
+    depgraph_invalidate(sp);
+    for (r = r1; r != r2; r += rstep) {
+        if (!sp->tbl[r >> TILE_ROWS_SHIFT]) {
+            /* skip the rest of the missing band */
+            if (rstep > 0) {
+                r |= TILE_ROWS - 1;
+                if (r >= r2) r = r2 - 1;
+            } else {
+                r &= ~(TILE_ROWS - 1);
+                if (r <= r2) r = r2 + 1;
+            }
+            continue;
+        }
+        for (c = c1; c != c2; c += cstep) {
+            struct ent **pp = tbl_slot(sp, r, c);
+            struct ent **qq;
+            if (!pp) {
+                /* skip the rest of the missing tile */
+                if (cstep > 0) {
+                    c |= TILE_COLS - 1;
+                    if (c >= c2) c = c2 - 1;
+                } else {
+                    c &= ~(TILE_COLS - 1);
+                    if (c <= c2) c = c2 + 1;
+                }
+                continue;
+            }
+            if (*pp) {
+                if ((qq = tbl_slot_alloc(sp, r + dr, c + dc)) != NULL) {
+                    *qq = *pp;
+                    *pp = NULL;
+                }
+            } else
+            if ((qq = tbl_slot(sp, r + dr, c + dc)) != NULL) {
+                *qq = NULL;
+            }
+        }
+    }
+}
+
+/* free the table structure, cells must have been freed already */
+void tbl_free(sheet_t *sp) {
+    int b, t, nbands = (sp->maxrows + TILE_ROWS - 1) >> TILE_ROWS_SHIFT;
+
+    if (sp->tbl) {
+        for (b = 0; b < nbands; b++) {
+            cellband_t *bp = sp->tbl[b];
+            if (bp) {
+                for (t = 0; t < TILE_NCOLS; t++) {
+                    scxfree(bp->tiles[t]);
+                }
+                scxfree(bp);
+            }
+        }
+        scxfree(sp->tbl);
+        sp->tbl = NULL;
+    }
+}
+
+/* return the value mirror for column col, (re)building it if needed.
+   return NULL if col is outside the table or on allocation failure */
+colmirror_t *colmirror_get(sheet_t *sp, int col) {
+    colmirror_t *mp;
+    int r, b, nrows = sp->maxrow + 1;
+
+    if (col < 0 || col >= sp->maxcols)
+        return NULL;
+    if (!sp->colmirror) {
+        sp->colmirror = scxmalloc(ABSMAXCOLS * sizeof(*sp->colmirror));
+        if (!sp->colmirror)
+            return NULL;
+        memset(sp->colmirror, 0, ABSMAXCOLS * sizeof(*sp->colmirror));
+    }
+    if (!(mp = sp->colmirror[col])) {
+        mp = scxmalloc(sizeof(*mp));
+        if (!mp)
+            return NULL;
+        memset(mp, 0, sizeof(*mp));
+        mp->ndirty = -1;
+        sp->colmirror[col] = mp;
+    }
+    if (mp->valid)
+        return mp;
+    if (mp->ndirty >= 0 && mp->nrows == nrows) {
+        /* reload the rows changed since the mirror was valid */
+        for (b = 0; b < mp->ndirty; b++) {
+            struct ent **pp = tbl_slot(sp, r = mp->dirty[b], col);
+            struct ent *p = pp ? *pp : NULL;
+            mp->type[r] = p ? p->type : SC_EMPTY;
+            mp->v[r] = p ? colmirror_value(p) : 0.0;
+            colmirror_prefix_cut(mp, r);
+        }
+        mp->ndirty = 0;
+        mp->valid = 1;
+        return mp;
+    }
+    if (mp->size < nrows) {
+        int size = grow_size(mp->size, nrows - 1, ABSMAXROWS + TILE_ROWS);
+        double *v = scxrealloc(mp->v, size * sizeof(*v));
+        unsigned char *type;
+        if (!v)
+            return NULL;
+        mp->v = v;
+        if (!(type = scxrealloc(mp->type, size * sizeof(*type))))
+            return NULL;
+        mp->type = type;
+        mp->size = size;
+    }
+    /* scan the column one tile at a time */
+    for (r = 0; r < nrows; r = b) {
+        cellband_t *bp = sp->tbl[r >> TILE_ROWS_SHIFT];
+        celltile_t *tp = bp ? bp->tiles[col >> TILE_COLS_SHIFT] : NULL;
+        struct ent **pp = tp ? tp->cp[col & (TILE_COLS - 1)] : NULL;
+        b = (r | (TILE_ROWS - 1)) + 1;
+        if (b > nrows) b = nrows;
+        for (; r < b; r++) {
+            struct ent *p = pp ? pp[r & (TILE_ROWS - 1)] : NULL;
+            if (!p) {
+                mp->type[r] = SC_EMPTY;
+                mp->v[r] = 0.0;
+            } else {
+                mp->type[r] = p->type;
+                mp->v[r] = colmirror_value(p);
+            }
+        }
+    }
+    mp->nrows = nrows;
+    mp->pvalid = 0;
+    mp->ndirty = 0;
+    mp->valid = 1;
+    return mp;
+}
+
+/* add x to the sum hi + lo without losing the low order bits */
+static inline void prefix_add(double *hip, double *lop, double x) {
+    double s = *hip + x;
+    double bp = s - *hip;
+    *lop += (*hip - (s - bp)) + (x - bp);
+    *hip = s;
+}
+
+/* extend the running totals of a valid column mirror up to entry n,
+   ie: for the rows 0 to n-1.  return FALSE on allocation failure.
+   Must not be called from the recalc threads.
+ */
+int colmirror_prefix(colmirror_t *mp, int n) {
+    int r;
+
+    if (n > mp->nrows)
+        n = mp->nrows;
+    if (mp->psize <= mp->nrows) {
+        colprefix_t *pp = scxrealloc(mp->prefix, (mp->size + 1) * sizeof(*pp));
+        if (!pp)
+            return FALSE;
+        mp->prefix = pp;
+        mp->psize = mp->size + 1;
+    }
+    if (mp->pvalid == 0)
+        memset(&mp->prefix[0], 0, sizeof(mp->prefix[0]));
+    for (r = mp->pvalid; r < n; r++) {
+        colprefix_t *pp = &mp->prefix[r + 1];
+        double x = mp->v[r];
+
+        *pp = pp[-1];
+        switch (mp->type[r]) {
+        case SC_NUMBER:
+            prefix_add(&pp->sum, &pp->sumlo, x);
+            prefix_add(&pp->sum2, &pp->sum2lo, x * x);
+            pp->count++;
+            break;
+        case SC_BOOLEAN:
+            pp->bsum += x;
+            pp->bsum2 += x * x;
+            pp->nbool++;
+            break;
+        case SC_STRING:
+        case SC_ERROR:
+            pp->nother++;
+            break;
+        }
+    }
+    if (mp->pvalid < n)
+        mp->pvalid = n;
+    return TRUE;
+}
+
+void colmirror_free(sheet_t *sp) {
+    int c;
+
+    if (sp->colmirror) {
+        for (c = 0; c < ABSMAXCOLS; c++) {
+            colmirror_t *mp = sp->colmirror[c];
+            if (mp) {
+                scxfree(mp->v);
+                scxfree(mp->type);
+                scxfree(mp->prefix);
+                scxfree(mp);
+            }
+        }
+        scxfree(sp->colmirror);
+        sp->colmirror = NULL;
+    }
+}